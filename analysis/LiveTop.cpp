@@ -0,0 +1,256 @@
+// cd_lab_top: live per-function view of a program running with TRACE_LIVE=1.
+//
+//   cd_lab_top <pid> [-i seconds] [-n rows] [-s key] [-1]
+//
+// Attaches read-only to the segment the runtime publishes (/cdlab.<pid>,
+// layout in runtime/live_format.h) and redraws every interval with the call
+// rate, share of time, latency percentiles and PAPI event rates of each
+// function over that interval. -s sorts by self (default), time, calls, p99
+// or an event name; -1 prints one frame and exits. A segment left behind by
+// a process that was killed is shown once, with totals since it started.
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "live_format.h"
+#include "runtime.h"
+
+#define SNAPSHOT_RETRIES 1000
+
+struct Snapshot {
+    LiveHeader Header;
+    std::vector<LiveFunction> Functions;
+};
+
+struct Row {
+    const LiveFunction *Function;
+    LiveStats Delta;
+    double Key;
+};
+
+static bool attach(int Pid, const LiveHeader *&Segment, std::string &Error) {
+    std::string Name = LIVE_SEGMENT_PREFIX + std::to_string(Pid);
+    int Fd = shm_open(Name.c_str(), O_RDONLY, 0);
+    if (Fd < 0) {
+        Error = Name + ": " + strerror(errno) + " (was the program started with TRACE_LIVE=1?)";
+        return false;
+    }
+    struct stat St;
+    if (fstat(Fd, &St) != 0 || (size_t)St.st_size < sizeof(LiveHeader)) {
+        close(Fd);
+        Error = Name + ": segment is too small";
+        return false;
+    }
+    void *P = mmap(nullptr, St.st_size, PROT_READ, MAP_SHARED, Fd, 0);
+    close(Fd);
+    if (P == MAP_FAILED) {
+        Error = Name + ": " + strerror(errno);
+        return false;
+    }
+
+    Segment = static_cast<const LiveHeader *>(P);
+    if (memcmp(Segment->magic, LIVE_MAGIC, sizeof(Segment->magic)) != 0 ||
+        Segment->version != LIVE_FORMAT_VERSION) {
+        Error = Name + ": not a cd-lab live segment of version " + std::to_string(LIVE_FORMAT_VERSION);
+        return false;
+    }
+    if (Segment->max_events != MAX_EVENTS || Segment->hist_buckets != LIVE_HIST_BUCKETS ||
+        Segment->function_size != sizeof(LiveFunction) ||
+        sizeof(LiveHeader) + (size_t)Segment->capacity * sizeof(LiveFunction) > (size_t)St.st_size) {
+        Error = Name + ": written by a runtime built with a different layout";
+        return false;
+    }
+    return true;
+}
+
+// Copies the segment between two updates of the runtime.
+static bool takeSnapshot(const LiveHeader *Segment, Snapshot &S) {
+    uint64_t *Seq = const_cast<uint64_t *>(&Segment->seq);
+    for (int Try = 0; Try < SNAPSHOT_RETRIES; ++Try) {
+        uint64_t Before = __atomic_load_n(Seq, __ATOMIC_ACQUIRE);
+        if (Before & 1) {
+            usleep(100);
+            continue;
+        }
+        memcpy(&S.Header, Segment, sizeof(LiveHeader));
+        uint32_t N = std::min(S.Header.num_functions, S.Header.capacity);
+        const LiveFunction *Functions = reinterpret_cast<const LiveFunction *>(Segment + 1);
+        S.Functions.assign(Functions, Functions + N);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(Seq, __ATOMIC_RELAXED) == Before) return true;
+    }
+    return false;
+}
+
+static LiveStats difference(const LiveStats &Now, const LiveStats *Before) {
+    LiveStats D = Now;
+    if (!Before) return D;
+    D.calls -= Before->calls;
+    D.measured -= Before->measured;
+    D.ns -= Before->ns;
+    D.self_ns -= Before->self_ns;
+    for (int I = 0; I < MAX_EVENTS; ++I) {
+        D.counts[I] -= Before->counts[I];
+        D.self_counts[I] -= Before->self_counts[I];
+    }
+    for (int B = 0; B < LIVE_HIST_BUCKETS; ++B) D.hist[B] -= Before->hist[B];
+    for (int G = 0; G < MAX_GROUPS; ++G) D.running_ns[G] -= Before->running_ns[G];
+    return D;
+}
+
+// With rotation an event only counted while its group was on the hardware.
+static double eventEstimate(const LiveHeader &H, const LiveStats &D, uint32_t Event, long long Count) {
+    if (H.multiplex_mode != MULTIPLEX_ROTATE) return (double)Count;
+    return (double)scale_count(Count, D.ns, D.running_ns[H.event_group[Event]]);
+}
+
+static std::string formatNs(double Ns) {
+    char Buf[32];
+    if (Ns < 1e3) snprintf(Buf, sizeof(Buf), "%.0fns", Ns);
+    else if (Ns < 1e6) snprintf(Buf, sizeof(Buf), "%.1fus", Ns / 1e3);
+    else if (Ns < 1e9) snprintf(Buf, sizeof(Buf), "%.1fms", Ns / 1e6);
+    else snprintf(Buf, sizeof(Buf), "%.2fs", Ns / 1e9);
+    return Buf;
+}
+
+static std::string formatCount(double V) {
+    char Buf[32];
+    if (V < 1e3) snprintf(Buf, sizeof(Buf), "%.0f", V);
+    else if (V < 1e6) snprintf(Buf, sizeof(Buf), "%.1fK", V / 1e3);
+    else if (V < 1e9) snprintf(Buf, sizeof(Buf), "%.1fM", V / 1e6);
+    else snprintf(Buf, sizeof(Buf), "%.1fG", V / 1e9);
+    return Buf;
+}
+
+static bool processAlive(int Pid) {
+    return kill(Pid, 0) == 0 || errno == EPERM;
+}
+
+// Prints the functions that were called between `Before` (null: since the
+// program started) and `Now`.
+static void printFrame(const Snapshot &Now, const Snapshot *Before, const std::string &SortKey, size_t MaxRows,
+                       bool Alive) {
+    const LiveHeader &H = Now.Header;
+    uint64_t Since = Before ? Before->Header.update_ns : H.start_ns;
+    double Seconds = H.update_ns > Since ? (H.update_ns - Since) / 1e9 : 0;
+
+    int EventKey = -1;
+    for (uint32_t I = 0; I < H.num_events; ++I) {
+        if (SortKey == H.event_names[I]) EventKey = (int)I;
+    }
+
+    std::vector<Row> Rows;
+    for (size_t Id = 0; Id < Now.Functions.size(); ++Id) {
+        const LiveStats *Old =
+            Before && Id < Before->Functions.size() ? &Before->Functions[Id].stats : nullptr;
+        Row R{&Now.Functions[Id], difference(Now.Functions[Id].stats, Old), 0};
+        if (R.Delta.calls == 0) continue;
+        if (EventKey >= 0) R.Key = eventEstimate(H, R.Delta, EventKey, R.Delta.self_counts[EventKey]);
+        else if (SortKey == "calls") R.Key = (double)R.Delta.calls;
+        else if (SortKey == "time") R.Key = (double)R.Delta.ns;
+        else if (SortKey == "p99") R.Key = live_percentile(R.Delta.hist, 0.99);
+        else R.Key = (double)R.Delta.self_ns;
+        Rows.push_back(R);
+    }
+    std::sort(Rows.begin(), Rows.end(), [](const Row &A, const Row &B) { return A.Key > B.Key; });
+
+    printf("cd_lab_top  pid %d  %s  %.1fs since %s  %u functions", H.pid,
+           H.exited ? "exited" : Alive ? "running" : "not running", Seconds,
+           Before ? "last refresh" : "start", H.num_functions);
+    if (H.registered > H.num_functions) {
+        printf(" (%u more not shown; raise TRACE_LIVE_CAPACITY)", H.registered - H.num_functions);
+    }
+    printf("\n\n%-40s %9s %7s %7s %9s %9s %9s", "function", "calls/s", "self%", "total%", "p50", "p90", "p99");
+    for (uint32_t I = 0; I < H.num_events; ++I) printf(" %14.14s/s", H.event_names[I]);
+    printf("\n");
+
+    for (size_t I = 0; I < Rows.size() && I < MaxRows; ++I) {
+        const Row &R = Rows[I];
+        const LiveStats &D = R.Delta;
+        // Time shares are of one CPU and only cover measured calls.
+        double Wall = Seconds > 0 ? Seconds * 1e9 : 1;
+        std::string P50 = D.measured ? formatNs(live_percentile(D.hist, 0.5)) : "-";
+        std::string P90 = D.measured ? formatNs(live_percentile(D.hist, 0.9)) : "-";
+        std::string P99 = D.measured ? formatNs(live_percentile(D.hist, 0.99)) : "-";
+        printf("%-40.40s %9s %6.1f%% %6.1f%% %9s %9s %9s", R.Function->name,
+               formatCount(Seconds > 0 ? D.calls / Seconds : (double)D.calls).c_str(), 100.0 * D.self_ns / Wall,
+               100.0 * D.ns / Wall, P50.c_str(), P90.c_str(), P99.c_str());
+        for (uint32_t E = 0; E < H.num_events; ++E) {
+            double Count = eventEstimate(H, D, E, D.self_counts[E]);
+            printf(" %16s", formatCount(Seconds > 0 ? Count / Seconds : Count).c_str());
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static int usage(const char *Argv0) {
+    fprintf(stderr, "Usage: %s <pid> [-i seconds] [-n rows] [-s self|time|calls|p99|<event>] [-1]\n", Argv0);
+    return 1;
+}
+
+int main(int argc, const char **argv) {
+    if (argc < 2) return usage(argv[0]);
+
+    int Pid = atoi(argv[1]);
+    double Interval = 1.0;
+    size_t MaxRows = 30;
+    std::string SortKey = "self";
+    bool Once = false;
+    for (int I = 2; I < argc; ++I) {
+        if (strcmp(argv[I], "-i") == 0 && I + 1 < argc) {
+            Interval = atof(argv[++I]);
+        } else if (strcmp(argv[I], "-n") == 0 && I + 1 < argc) {
+            MaxRows = (size_t)atol(argv[++I]);
+        } else if (strcmp(argv[I], "-s") == 0 && I + 1 < argc) {
+            SortKey = argv[++I];
+        } else if (strcmp(argv[I], "-1") == 0) {
+            Once = true;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (Pid <= 0 || Interval <= 0) return usage(argv[0]);
+
+    std::string Error;
+    const LiveHeader *Segment = nullptr;
+    if (!attach(Pid, Segment, Error)) {
+        fprintf(stderr, "cd_lab_top: %s\n", Error.c_str());
+        return 1;
+    }
+
+    Snapshot Previous, Current;
+    if (!takeSnapshot(Segment, Previous)) {
+        fprintf(stderr, "cd_lab_top: segment is being rewritten too often to read\n");
+        return 1;
+    }
+    if (Previous.Header.exited || !processAlive(Pid)) {
+        printFrame(Previous, nullptr, SortKey, MaxRows, false);
+        return 0;
+    }
+
+    for (;;) {
+        usleep((useconds_t)(Interval * 1e6));
+        if (!takeSnapshot(Segment, Current)) continue;
+        bool Alive = !Current.Header.exited && processAlive(Pid);
+        // Until the runtime publishes again there is no new interval to show.
+        bool Fresh = Current.Header.update_ns != Previous.Header.update_ns;
+        if (!Fresh && Alive && !Once) continue;
+        if (!Once) printf("\033[H\033[2J");
+        printFrame(Current, Fresh ? &Previous : nullptr, SortKey, MaxRows, Alive);
+        if (Once || !Alive) break;
+        if (Fresh) Previous = std::move(Current);
+    }
+    return 0;
+}
@@ -0,0 +1,306 @@
+// cd_lab_trace: converts binary traces written by the runtime.
+//
+//   cd_lab_trace csv       <trace.cdlt> [-o out.csv]   one row per call
+//   cd_lab_trace chrome    <trace.cdlt> [-o out.json]  Chrome/Perfetto trace
+//   cd_lab_trace summary   <trace.cdlt> [-o out.csv]   per-function totals
+//   cd_lab_trace functions <trace.cdlt> [-o out.csv]   function table
+//
+// Every command streams the records, so traces larger than memory convert
+// in a single pass.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "TraceReader.h"
+#include "runtime.h"
+#include "runtime_internal.h"
+
+static void printSeconds(FILE *Out, uint64_t Ns) {
+    fprintf(Out, "%" PRIu64 ".%09" PRIu64, Ns / UINT64_C(1000000000), Ns % UINT64_C(1000000000));
+}
+
+static const char *kindName(unsigned Kind) {
+    switch (Kind) {
+    case RUNTIME_KIND_LOOP: return "loop";
+    case RUNTIME_KIND_REGION: return "region";
+    default: return "function";
+    }
+}
+
+// With rotation, events were only counted while their group was on the
+// hardware; the counts are scaled up to the whole interval. Returns false
+// when the group never counted during it, so the value is unknown.
+static bool scaledCount(const TraceReader &Reader, size_t Event, int64_t Count, uint64_t EnabledNs,
+                        const std::vector<uint64_t> &RunningNs, int64_t &Out) {
+    Out = Count;
+    if (Reader.multiplexMode() != MULTIPLEX_ROTATE) return true;
+    uint64_t Running = RunningNs[Reader.eventGroups()[Event]];
+    Out = scale_count(Count, EnabledNs, Running);
+    return Running > 0;
+}
+
+static void printRunning(FILE *Out, const TraceReader &Reader, uint64_t EnabledNs,
+                         const std::vector<uint64_t> &RunningNs) {
+    if (Reader.multiplexMode() != MULTIPLEX_ROTATE) return;
+    for (unsigned Group : Reader.eventGroups()) {
+        double Share = EnabledNs ? (double)RunningNs[Group] / (double)EnabledNs : 0;
+        fprintf(Out, ",%.3f", std::min(Share, 1.0));
+    }
+}
+
+static std::string jsonEscape(const std::string &S) {
+    std::string Out;
+    for (char C : S) {
+        if (C == '"' || C == '\\') {
+            Out += '\\';
+            Out += C;
+        } else if ((unsigned char)C < 0x20) {
+            char Buf[8];
+            snprintf(Buf, sizeof(Buf), "\\u%04x", C);
+            Out += Buf;
+        } else {
+            Out += C;
+        }
+    }
+    return Out;
+}
+
+// Same layout the runtime used to write directly.
+static bool exportCsv(TraceReader &Reader, FILE *Out, std::string &Error) {
+    const auto &Events = Reader.events();
+    fprintf(Out, "function_name,start_timestamp,end_timestamp");
+    for (const auto &E : Events) fprintf(Out, ",%s", E.c_str());
+    fprintf(Out, ",depth,self_time");
+    for (const auto &E : Events) fprintf(Out, ",%s_self", E.c_str());
+    fprintf(Out, ",function_id,trips,total_time");
+    // With rotation: the share of each call its event's group was counted.
+    if (Reader.multiplexMode() == MULTIPLEX_ROTATE) {
+        for (const auto &E : Events) fprintf(Out, ",%s_running", E.c_str());
+    }
+    fprintf(Out, "\n");
+
+    // Timestamps are taken on the monotonic clock; the header says where
+    // that was in wall-clock time, so rows show seconds since the epoch.
+    uint64_t Realtime = Reader.realtimeOffsetNs();
+    std::vector<std::string> Names;
+    // Counts whose group never ran during the call are left empty.
+    auto PrintCounts = [&](const TraceRecord &R, const std::vector<int64_t> &Counts) {
+        for (size_t E = 0; E < Counts.size(); ++E) {
+            int64_t V;
+            if (scaledCount(Reader, E, Counts[E], R.Ns, R.RunningNs, V)) {
+                fprintf(Out, ",%" PRId64, V);
+            } else {
+                fputc(',', Out);
+            }
+        }
+    };
+    return Reader.forEachRecord([&](const TraceRecord &R) {
+        if (R.FuncId >= Names.size()) Names.resize(R.FuncId + 1);
+        if (Names[R.FuncId].empty()) Names[R.FuncId] = Reader.functionName(R.FuncId);
+
+        fprintf(Out, "%s,", Names[R.FuncId].c_str());
+        printSeconds(Out, R.StartNs + Realtime);
+        fputc(',', Out);
+        printSeconds(Out, R.EndNs + Realtime);
+        PrintCounts(R, R.Counters);
+        fprintf(Out, ",%u,", R.Depth);
+        printSeconds(Out, R.SelfNs);
+        PrintCounts(R, R.SelfCounters);
+        fprintf(Out, ",%u,%" PRIu64 ",", R.FuncId, R.Trips);
+        printSeconds(Out, R.Ns);
+        printRunning(Out, Reader, R.Ns, R.RunningNs);
+        fputc('\n', Out);
+    }, Error);
+}
+
+// Complete ("X") events in microseconds, loadable by chrome://tracing and
+// ui.perfetto.dev.
+static bool exportChrome(TraceReader &Reader, FILE *Out, std::string &Error) {
+    const auto &Events = Reader.events();
+    const auto &Functions = Reader.functions();
+    std::vector<std::string> Names;
+    bool First = true;
+
+    fprintf(Out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool Ok = Reader.forEachRecord([&](const TraceRecord &R) {
+        if (R.FuncId >= Names.size()) Names.resize(R.FuncId + 1);
+        if (Names[R.FuncId].empty()) Names[R.FuncId] = jsonEscape(Reader.functionName(R.FuncId));
+
+        unsigned Kind = R.FuncId < Functions.size() ? Functions[R.FuncId].Kind : RUNTIME_KIND_FUNCTION;
+        fprintf(Out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                     "\"ts\":%" PRIu64 ".%03" PRIu64 ",\"dur\":%" PRIu64 ".%03" PRIu64 ",\"args\":{",
+                First ? "" : ",\n", Names[R.FuncId].c_str(), kindName(Kind), R.ThreadId,
+                R.StartNs / 1000, R.StartNs % 1000,
+                (R.EndNs - R.StartNs) / 1000, (R.EndNs - R.StartNs) % 1000);
+        // ts and dur are as measured, so that calls nest; ns and self_ns
+        // have the probe cost taken out.
+        fprintf(Out, "\"ns\":%" PRIu64 ",\"self_ns\":%" PRIu64, R.Ns, R.SelfNs);
+        if (Kind == RUNTIME_KIND_LOOP) fprintf(Out, ",\"trips\":%" PRIu64, R.Trips);
+        for (size_t E = 0; E < Events.size(); ++E) {
+            int64_t Incl, Self;
+            if (!scaledCount(Reader, E, R.Counters[E], R.Ns, R.RunningNs, Incl)) continue;
+            scaledCount(Reader, E, R.SelfCounters[E], R.Ns, R.RunningNs, Self);
+            fprintf(Out, ",\"%s\":%" PRId64 ",\"%s_self\":%" PRId64, Events[E].c_str(), Incl,
+                    Events[E].c_str(), Self);
+        }
+        fprintf(Out, "}}");
+        First = false;
+    }, Error);
+    fprintf(Out, "\n]}\n");
+    return Ok;
+}
+
+struct FunctionSummary {
+    uint64_t Calls = 0;
+    uint64_t TotalNs = 0;
+    uint64_t SelfNs = 0;
+    uint64_t MinNs = UINT64_MAX;
+    uint64_t MaxNs = 0;
+    uint64_t Trips = 0;
+    std::vector<int64_t> Counters;
+    std::vector<int64_t> SelfCounters;
+    std::vector<uint64_t> RunningNs;
+};
+
+static bool exportSummary(TraceReader &Reader, FILE *Out, std::string &Error) {
+    const auto &Events = Reader.events();
+    std::vector<FunctionSummary> Summaries;
+
+    bool Ok = Reader.forEachRecord([&](const TraceRecord &R) {
+        if (R.FuncId >= Summaries.size()) Summaries.resize(R.FuncId + 1);
+        FunctionSummary &S = Summaries[R.FuncId];
+        if (S.Counters.empty()) {
+            S.Counters.assign(Events.size(), 0);
+            S.SelfCounters.assign(Events.size(), 0);
+            S.RunningNs.assign(R.RunningNs.size(), 0);
+        }
+        uint64_t Ns = R.Ns;
+        S.Calls++;
+        S.TotalNs += Ns;
+        S.SelfNs += R.SelfNs;
+        S.MinNs = std::min(S.MinNs, Ns);
+        S.MaxNs = std::max(S.MaxNs, Ns);
+        S.Trips += R.Trips;
+        for (size_t E = 0; E < Events.size(); ++E) {
+            S.Counters[E] += R.Counters[E];
+            S.SelfCounters[E] += R.SelfCounters[E];
+        }
+        for (size_t G = 0; G < R.RunningNs.size(); ++G) S.RunningNs[G] += R.RunningNs[G];
+    }, Error);
+    if (!Ok) return false;
+
+    // calls counts records; total_calls also counts calls that throttling
+    // or sampling left unrecorded (0 if the trace was not closed cleanly).
+    // With rotation, event totals are scaled by the function's total time
+    // over the time their group counted, which <event>_running gives as a
+    // share; totals whose group never counted are left empty.
+    fprintf(Out, "function_id,function_name,calls,total_calls,total_ns,self_ns,mean_ns,min_ns,max_ns");
+    for (const auto &E : Events) fprintf(Out, ",%s", E.c_str());
+    for (const auto &E : Events) fprintf(Out, ",%s_self", E.c_str());
+    fprintf(Out, ",trips");
+    if (Reader.multiplexMode() == MULTIPLEX_ROTATE) {
+        for (const auto &E : Events) fprintf(Out, ",%s_running", E.c_str());
+    }
+    fprintf(Out, "\n");
+
+    for (uint32_t Id = 0; Id < Summaries.size(); ++Id) {
+        const FunctionSummary &S = Summaries[Id];
+        if (S.Calls == 0) continue;
+        uint64_t TotalCalls = Id < Reader.functions().size() ? Reader.functions()[Id].Calls : 0;
+        fprintf(Out, "%u,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+                Id, Reader.functionName(Id).c_str(), S.Calls, TotalCalls, S.TotalNs, S.SelfNs,
+                S.TotalNs / S.Calls, S.MinNs, S.MaxNs);
+        for (const auto *Counts : {&S.Counters, &S.SelfCounters}) {
+            for (size_t E = 0; E < Counts->size(); ++E) {
+                int64_t V;
+                if (scaledCount(Reader, E, (*Counts)[E], S.TotalNs, S.RunningNs, V)) fprintf(Out, ",%" PRId64, V);
+                else fputc(',', Out);
+            }
+        }
+        fprintf(Out, ",%" PRIu64, S.Trips);
+        printRunning(Out, Reader, S.TotalNs, S.RunningNs);
+        fputc('\n', Out);
+    }
+    return true;
+}
+
+static bool exportFunctions(TraceReader &Reader, FILE *Out, std::string &Error) {
+    if (!Reader.complete()) {
+        Error = "trace has no function table (the program did not exit cleanly)";
+        return false;
+    }
+    fprintf(Out, "function_id,name,mangled_name,file,line,scope,kind\n");
+    const auto &Functions = Reader.functions();
+    for (uint32_t Id = 0; Id < Functions.size(); ++Id) {
+        const TraceFunction &F = Functions[Id];
+        if (F.Name.empty()) continue;  // ID 0 is reserved
+        fprintf(Out, "%u,%s,%s,%s,%u,%s,%s\n", Id, F.Name.c_str(), F.MangledName.c_str(), F.File.c_str(),
+                F.Line, F.Scope.c_str(), kindName(F.Kind));
+    }
+    return true;
+}
+
+static int usage(const char *Argv0) {
+    fprintf(stderr, "Usage: %s <csv|chrome|summary|functions> <trace.cdlt> [-o output]\n", Argv0);
+    return 1;
+}
+
+int main(int argc, const char **argv) {
+    if (argc < 3) return usage(argv[0]);
+
+    std::string Command = argv[1];
+    std::string TracePath = argv[2];
+    std::string OutputPath;
+    for (int I = 3; I < argc; ++I) {
+        if (strcmp(argv[I], "-o") == 0 && I + 1 < argc) {
+            OutputPath = argv[++I];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    bool (*Export)(TraceReader &, FILE *, std::string &) = nullptr;
+    if (Command == "csv") Export = exportCsv;
+    else if (Command == "chrome") Export = exportChrome;
+    else if (Command == "summary") Export = exportSummary;
+    else if (Command == "functions") Export = exportFunctions;
+    else return usage(argv[0]);
+
+    std::string Error;
+    TraceReader Reader;
+    if (!Reader.open(TracePath, Error)) {
+        fprintf(stderr, "cd_lab_trace: %s\n", Error.c_str());
+        return 1;
+    }
+    if (!Reader.complete()) {
+        fprintf(stderr, "cd_lab_trace: warning: %s was not closed cleanly; function names are unavailable\n",
+                TracePath.c_str());
+    } else if (Reader.recordsDropped() > 0) {
+        fprintf(stderr, "cd_lab_trace: warning: %" PRIu64 " records were dropped while tracing\n",
+                Reader.recordsDropped());
+    }
+
+    FILE *Out = stdout;
+    if (!OutputPath.empty()) {
+        Out = fopen(OutputPath.c_str(), "w");
+        if (!Out) {
+            perror(OutputPath.c_str());
+            return 1;
+        }
+    }
+    setvbuf(Out, nullptr, _IOFBF, 1 << 20);
+
+    bool Ok = Export(Reader, Out, Error);
+    if (Out != stdout) fclose(Out);
+    else fflush(Out);
+
+    if (!Ok) {
+        fprintf(stderr, "cd_lab_trace: %s\n", Error.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "TraceReader.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/types.h>
+
+#include "runtime_internal.h"
+#include "trace_format.h"
+
+std::string TraceFunction::displayName() const {
+    return Scope.empty() ? Name : Scope + "::" + Name;
+}
+
+TraceReader::~TraceReader() {
+    if (File) fclose(File);
+}
+
+static bool readExact(FILE *F, void *Buf, size_t N) {
+    return fread(Buf, 1, N, F) == N;
+}
+
+static bool getString(const uint8_t *&P, const uint8_t *End, std::string &Out) {
+    uint64_t Len;
+    if (!trace_get_varint(&P, End, &Len) || Len > (uint64_t)(End - P)) return false;
+    Out.assign(reinterpret_cast<const char *>(P), Len);
+    P += Len;
+    return true;
+}
+
+bool TraceReader::open(const std::string &Path, std::string &Error) {
+    File = fopen(Path.c_str(), "rb");
+    if (!File) {
+        Error = "cannot open " + Path + ": " + strerror(errno);
+        return false;
+    }
+    setvbuf(File, nullptr, _IOFBF, 1 << 20);
+
+    uint8_t Header[20];
+    if (!readExact(File, Header, sizeof(Header)) || memcmp(Header, TRACE_MAGIC, 4) != 0) {
+        Error = Path + " is not a cd-lab trace";
+        return false;
+    }
+    unsigned Version = trace_get_u16(Header + 4);
+    if (Version != TRACE_FORMAT_VERSION) {
+        Error = "unsupported trace format version " + std::to_string(Version);
+        return false;
+    }
+    RealtimeOffsetNs = trace_get_u64(Header + 8);
+
+    uint32_t NumEvents = trace_get_u32(Header + 16);
+    for (uint32_t I = 0; I < NumEvents; ++I) {
+        uint8_t LenBuf[2];
+        if (!readExact(File, LenBuf, 2)) {
+            Error = "truncated trace header";
+            return false;
+        }
+        std::string Name(trace_get_u16(LenBuf), '\0');
+        if (!readExact(File, Name.data(), Name.size())) {
+            Error = "truncated trace header";
+            return false;
+        }
+        Events.push_back(Name);
+    }
+    std::vector<uint8_t> Groups(2 + NumEvents);
+    if (!readExact(File, Groups.data(), Groups.size())) {
+        Error = "truncated trace header";
+        return false;
+    }
+    MultiplexMode = Groups[0];
+    NumGroups = Groups[1];
+    EventGroups.assign(Groups.begin() + 2, Groups.end());
+    DataStart = ftello(File);
+
+    return readFooter(Error);
+}
+
+bool TraceReader::readFooter(std::string &Error) {
+    const off_t FooterSize = TRACE_BLOCK_HEADER_SIZE + TRACE_END_PAYLOAD_SIZE;
+    if (fseeko(File, 0, SEEK_END) != 0) return true;
+    off_t Size = ftello(File);
+    if (Size - FooterSize < DataStart) return true;
+
+    uint8_t Footer[TRACE_BLOCK_HEADER_SIZE + TRACE_END_PAYLOAD_SIZE];
+    if (fseeko(File, Size - FooterSize, SEEK_SET) != 0 || !readExact(File, Footer, sizeof(Footer)))
+        return true;
+    if (trace_get_u32(Footer) != TRACE_BLOCK_END || trace_get_u32(Footer + 4) != TRACE_END_PAYLOAD_SIZE)
+        return true;
+
+    uint64_t FunctionsOffset = trace_get_u64(Footer + 8);
+    RecordsWritten = trace_get_u64(Footer + 16);
+    RecordsDropped = trace_get_u64(Footer + 24);
+    if (!readFunctions(FunctionsOffset, Error)) return false;
+    Complete = true;
+    return true;
+}
+
+bool TraceReader::readFunctions(uint64_t Offset, std::string &Error) {
+    uint8_t Header[TRACE_BLOCK_HEADER_SIZE];
+    if (fseeko(File, (off_t)Offset, SEEK_SET) != 0 || !readExact(File, Header, sizeof(Header)) ||
+        trace_get_u32(Header) != TRACE_BLOCK_FUNCTIONS) {
+        Error = "function table missing";
+        return false;
+    }
+    std::vector<uint8_t> Payload(trace_get_u32(Header + 4));
+    if (!readExact(File, Payload.data(), Payload.size())) {
+        Error = "truncated function table";
+        return false;
+    }
+
+    const uint8_t *P = Payload.data();
+    const uint8_t *End = P + Payload.size();
+    uint64_t Count;
+    if (!trace_get_varint(&P, End, &Count)) {
+        Error = "corrupt function table";
+        return false;
+    }
+    for (uint64_t I = 0; I < Count; ++I) {
+        uint64_t Id, Line, Kind;
+        TraceFunction F;
+        if (!trace_get_varint(&P, End, &Id) || !getString(P, End, F.Name) ||
+            !getString(P, End, F.MangledName) || !getString(P, End, F.File) ||
+            !trace_get_varint(&P, End, &Line) || !getString(P, End, F.Scope) ||
+            !trace_get_varint(&P, End, &F.Calls) || !trace_get_varint(&P, End, &F.Recorded) ||
+            !trace_get_varint(&P, End, &Kind)) {
+            Error = "corrupt function table";
+            return false;
+        }
+        F.Kind = (unsigned)Kind;
+        F.Line = (unsigned)Line;
+        if (Id >= Functions.size()) Functions.resize(Id + 1);
+        Functions[Id] = std::move(F);
+    }
+    return true;
+}
+
+std::string TraceReader::functionName(uint32_t Id) const {
+    if (Id < Functions.size() && !Functions[Id].Name.empty()) return Functions[Id].displayName();
+    return "fn" + std::to_string(Id);
+}
+
+bool TraceReader::forEachRecord(const std::function<void(const TraceRecord &)> &Fn, std::string &Error) {
+    if (fseeko(File, DataStart, SEEK_SET) != 0) {
+        Error = "seek failed";
+        return false;
+    }
+
+    const size_t NumEvents = Events.size();
+    std::vector<uint8_t> Payload;
+    TraceRecord R;
+    R.Counters.resize(NumEvents);
+    R.SelfCounters.resize(NumEvents);
+    const size_t NumRunning = MultiplexMode == MULTIPLEX_ROTATE ? NumGroups : 0;
+    R.RunningNs.resize(NumRunning);
+
+    for (;;) {
+        off_t BlockOffset = ftello(File);
+        uint8_t Header[TRACE_BLOCK_HEADER_SIZE];
+        if (!readExact(File, Header, sizeof(Header))) return true;  // crashed trace: end of data
+
+        uint32_t Type = trace_get_u32(Header);
+        uint32_t Size = trace_get_u32(Header + 4);
+        // Zero-filled slack past the last block of an unclosed trace.
+        if (Type == 0) return true;
+        if (Type == TRACE_BLOCK_END) return true;
+        if (Type != TRACE_BLOCK_THREAD_CHUNK) {
+            if (fseeko(File, Size, SEEK_CUR) != 0) return true;
+            continue;
+        }
+
+        Payload.resize(Size);
+        if (!readExact(File, Payload.data(), Size)) return true;
+
+        const uint8_t *P = Payload.data();
+        const uint8_t *End = P + Size;
+        uint64_t ThreadId, Count;
+        if (!trace_get_varint(&P, End, &ThreadId) || !trace_get_varint(&P, End, &Count)) {
+            Error = "corrupt chunk at offset " + std::to_string((long long)BlockOffset);
+            return false;
+        }
+
+        uint64_t PrevEnd = 0;
+        for (uint64_t I = 0; I < Count; ++I) {
+            uint64_t FuncId, Depth, EndDelta, Duration, Ns, Self, Trips = 0;
+            bool Ok = trace_get_varint(&P, End, &FuncId) && trace_get_varint(&P, End, &Depth) &&
+                      trace_get_varint(&P, End, &EndDelta) && trace_get_varint(&P, End, &Duration) &&
+                      trace_get_varint(&P, End, &Ns) && trace_get_varint(&P, End, &Self) &&
+                      trace_get_varint(&P, End, &Trips);
+            for (size_t E = 0; Ok && E < NumEvents; ++E) {
+                uint64_t Incl = 0, SelfCount = 0;
+                Ok = trace_get_varint(&P, End, &Incl) && trace_get_varint(&P, End, &SelfCount);
+                R.Counters[E] = trace_unzigzag(Incl);
+                R.SelfCounters[E] = trace_unzigzag(SelfCount);
+            }
+            for (size_t G = 0; Ok && G < NumRunning; ++G) {
+                Ok = trace_get_varint(&P, End, &R.RunningNs[G]);
+            }
+            if (!Ok) {
+                Error = "corrupt record in chunk at offset " + std::to_string((long long)BlockOffset);
+                return false;
+            }
+
+            PrevEnd += EndDelta;
+            R.ThreadId = (uint32_t)ThreadId;
+            R.FuncId = (uint32_t)FuncId;
+            R.Depth = (uint32_t)Depth;
+            R.EndNs = PrevEnd;
+            R.StartNs = PrevEnd - Duration;
+            R.Ns = Ns;
+            R.SelfNs = Self;
+            R.Trips = Trips;
+            Fn(R);
+        }
+    }
+}
@@ -0,0 +1,89 @@
+// analysis/TraceReader.h
+//
+// Streaming reader for the binary traces written by the runtime (see
+// runtime/trace_format.h). Records are decoded one chunk at a time, so
+// memory use does not depend on the size of the trace.
+
+#ifndef CD_LAB_TRACE_READER_H
+#define CD_LAB_TRACE_READER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct TraceFunction {
+    std::string Name;
+    std::string MangledName;
+    std::string File;
+    unsigned Line = 0;
+    std::string Scope;
+    uint64_t Calls = 0;     // calls made, including ones not recorded
+    uint64_t Recorded = 0;  // calls that produced a record
+    unsigned Kind = 0;      // RUNTIME_KIND_* (function, loop or region)
+
+    // "scope::name", or just the name at file scope.
+    std::string displayName() const;
+};
+
+struct TraceRecord {
+    uint32_t ThreadId = 0;
+    uint32_t FuncId = 0;
+    uint32_t Depth = 0;
+    uint64_t StartNs = 0;
+    uint64_t EndNs = 0;
+    uint64_t Ns = 0;  // inclusive, probe overhead removed
+    uint64_t SelfNs = 0;
+    uint64_t Trips = 0;  // loop iterations, 0 for functions
+    std::vector<int64_t> Counters;      // inclusive
+    std::vector<int64_t> SelfCounters;  // excluding instrumented callees
+    // With rotation, how long each counter group was counting; the counts
+    // of its events cover only that part of the call.
+    std::vector<uint64_t> RunningNs;
+};
+
+class TraceReader {
+public:
+    ~TraceReader();
+
+    bool open(const std::string &Path, std::string &Error);
+
+    const std::vector<std::string> &events() const { return Events; }
+    // MULTIPLEX_* from runtime_internal.h, and the counter group of each event.
+    unsigned multiplexMode() const { return MultiplexMode; }
+    unsigned numGroups() const { return NumGroups; }
+    const std::vector<unsigned> &eventGroups() const { return EventGroups; }
+    uint64_t realtimeOffsetNs() const { return RealtimeOffsetNs; }
+
+    // False for traces cut short by a crash; the function table and the
+    // counts below are then unavailable.
+    bool complete() const { return Complete; }
+    uint64_t recordsWritten() const { return RecordsWritten; }
+    uint64_t recordsDropped() const { return RecordsDropped; }
+
+    const std::vector<TraceFunction> &functions() const { return Functions; }
+    std::string functionName(uint32_t Id) const;
+
+    // Calls Fn for every record in file order. Returns false if the data is
+    // corrupt; Error then says where.
+    bool forEachRecord(const std::function<void(const TraceRecord &)> &Fn, std::string &Error);
+
+private:
+    bool readFooter(std::string &Error);
+    bool readFunctions(uint64_t Offset, std::string &Error);
+
+    FILE *File = nullptr;
+    int64_t DataStart = 0;
+    std::vector<std::string> Events;
+    unsigned MultiplexMode = 0;
+    unsigned NumGroups = 1;
+    std::vector<unsigned> EventGroups;
+    uint64_t RealtimeOffsetNs = 0;
+    bool Complete = false;
+    uint64_t RecordsWritten = 0;
+    uint64_t RecordsDropped = 0;
+    std::vector<TraceFunction> Functions;
+};
+
+#endif // CD_LAB_TRACE_READER_H
@@ -0,0 +1,330 @@
+// cd_lab_bench: end-to-end cost of instrumentation on the workload corpus.
+//
+//   cd_lab_bench [-d dir] [-r runs] [-e events] [-o out.json] [workload...]
+//
+// Runs each workload's plain build (<dir>/<name>) and instrumented build
+// (<dir>/<name>_instrumented) `runs` times each, alternating, and reports the
+// median wall, user and system time, peak RSS, trace size, the records the
+// runtime wrote and dropped (a run that drops records understates the cost
+// of recording them) and the PAPI
+// events (-e, default PAPI_TOT_INS,PAPI_TOT_CYC; `none` to skip) counted for
+// the whole process tree from outside. The ratios of instrumented to plain
+// are the slowdown, the memory overhead and the counter perturbation that
+// probes cause in the program they measure.
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <papi.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "trace_format.h"
+
+struct RunStats {
+    double WallS = 0;
+    double UserS = 0;
+    double SysS = 0;
+    double MaxRssKb = 0;
+    double TraceBytes = 0;
+    double Records = 0;
+    double Dropped = 0;
+    std::vector<double> Counts;
+};
+
+struct Measurement {
+    std::vector<RunStats> Runs;
+
+    double median(double RunStats::*Field) const {
+        std::vector<double> V;
+        for (const RunStats &R : Runs) V.push_back(R.*Field);
+        std::sort(V.begin(), V.end());
+        return V.empty() ? 0 : V[V.size() / 2];
+    }
+
+    double medianCount(size_t Event) const {
+        std::vector<double> V;
+        for (const RunStats &R : Runs) {
+            if (Event < R.Counts.size()) V.push_back(R.Counts[Event]);
+        }
+        std::sort(V.begin(), V.end());
+        return V.empty() ? -1 : V[V.size() / 2];
+    }
+};
+
+static double nowSeconds() {
+    struct timespec Ts;
+    clock_gettime(CLOCK_MONOTONIC, &Ts);
+    return (double)Ts.tv_sec + (double)Ts.tv_nsec * 1e-9;
+}
+
+static double seconds(const struct timeval &Tv) { return (double)Tv.tv_sec + (double)Tv.tv_usec * 1e-6; }
+
+static void removeDirectory(const std::string &Dir) {
+    if (DIR *D = opendir(Dir.c_str())) {
+        while (struct dirent *E = readdir(D)) {
+            if (strcmp(E->d_name, ".") != 0 && strcmp(E->d_name, "..") != 0) unlink((Dir + "/" + E->d_name).c_str());
+        }
+        closedir(D);
+    }
+    rmdir(Dir.c_str());
+}
+
+// Counts `Codes` in the process `Pid` and every thread and child it starts
+// from now on.
+static bool attachCounters(pid_t Pid, std::vector<int> &Codes, int &Set) {
+    Set = PAPI_NULL;
+    PAPI_option_t Opt;
+    memset(&Opt, 0, sizeof(Opt));
+    int Rc = PAPI_create_eventset(&Set);
+    if (Rc == PAPI_OK) Rc = PAPI_assign_eventset_component(Set, 0);
+    if (Rc == PAPI_OK) Rc = PAPI_attach(Set, (unsigned long)Pid);
+    if (Rc == PAPI_OK) {
+        Opt.inherit.eventset = Set;
+        Opt.inherit.inherit = PAPI_INHERIT_ALL;
+        Rc = PAPI_set_opt(PAPI_INHERIT, &Opt);
+    }
+    if (Rc == PAPI_OK) Rc = PAPI_add_events(Set, Codes.data(), (int)Codes.size());
+    if (Rc == PAPI_OK) Rc = PAPI_start(Set);
+    if (Rc != PAPI_OK) {
+        fprintf(stderr, "cd_lab_bench: cannot count events in the workload: %s; continuing without\n",
+                PAPI_strerror(Rc));
+        if (Set != PAPI_NULL) {
+            PAPI_cleanup_eventset(Set);
+            PAPI_destroy_eventset(&Set);
+        }
+        Codes.clear();
+        return false;
+    }
+    return true;
+}
+
+// Runs `Path` once in a scratch directory that receives its trace. The child
+// waits on a pipe until the counters are attached, then execs.
+// Reads the record counts from the END block that closes a trace; leaves
+// them at zero if there is no closed trace.
+static void readTraceCounts(const std::string &Trace, RunStats &Stats) {
+    uint8_t End[TRACE_BLOCK_HEADER_SIZE + TRACE_END_PAYLOAD_SIZE];
+    FILE *F = fopen(Trace.c_str(), "rb");
+    if (!F) return;
+    bool Ok = fseeko(F, -(off_t)sizeof(End), SEEK_END) == 0 && fread(End, 1, sizeof(End), F) == sizeof(End) &&
+              trace_get_u32(End) == TRACE_BLOCK_END && trace_get_u32(End + 4) == TRACE_END_PAYLOAD_SIZE;
+    fclose(F);
+    if (!Ok) return;
+    Stats.Records = (double)trace_get_u64(End + TRACE_BLOCK_HEADER_SIZE + 8);
+    Stats.Dropped = (double)trace_get_u64(End + TRACE_BLOCK_HEADER_SIZE + 16);
+}
+
+static bool runOnce(const std::string &Path, std::vector<int> &Codes, RunStats &Stats, std::string &Error) {
+    char Dir[] = "/tmp/cd_lab_bench.XXXXXX";
+    if (!mkdtemp(Dir)) {
+        Error = std::string("mkdtemp: ") + strerror(errno);
+        return false;
+    }
+    std::string Trace = std::string(Dir) + "/trace.cdlt";
+
+    int Go[2];
+    if (pipe(Go) != 0) {
+        Error = std::string("pipe: ") + strerror(errno);
+        removeDirectory(Dir);
+        return false;
+    }
+    pid_t Pid = fork();
+    if (Pid == 0) {
+        close(Go[1]);
+        char Byte;
+        if (read(Go[0], &Byte, 1) != 1) _exit(127);
+        if (chdir(Dir) != 0) _exit(127);
+        setenv("TRACE_OUTPUT", Trace.c_str(), 1);
+        // The workloads print a checksum and the runtime its calibration.
+        int Null = open("/dev/null", O_WRONLY);
+        dup2(Null, STDOUT_FILENO);
+        dup2(Null, STDERR_FILENO);
+        execl(Path.c_str(), Path.c_str(), (char *)nullptr);
+        _exit(127);
+    }
+    close(Go[0]);
+    if (Pid < 0) {
+        close(Go[1]);
+        Error = std::string("fork: ") + strerror(errno);
+        removeDirectory(Dir);
+        return false;
+    }
+
+    int Set = PAPI_NULL;
+    bool Counting = !Codes.empty() && attachCounters(Pid, Codes, Set);
+    double Start = nowSeconds();
+    if (write(Go[1], "x", 1) != 1) kill(Pid, SIGKILL);
+    close(Go[1]);
+
+    int Status = 0;
+    struct rusage Usage;
+    memset(&Usage, 0, sizeof(Usage));
+    wait4(Pid, &Status, 0, &Usage);
+    Stats.WallS = nowSeconds() - Start;
+    Stats.UserS = seconds(Usage.ru_utime);
+    Stats.SysS = seconds(Usage.ru_stime);
+    Stats.MaxRssKb = (double)Usage.ru_maxrss;
+
+    if (Counting) {
+        std::vector<long long> Values(Codes.size());
+        if (PAPI_stop(Set, Values.data()) == PAPI_OK) Stats.Counts.assign(Values.begin(), Values.end());
+        PAPI_cleanup_eventset(Set);
+        PAPI_destroy_eventset(&Set);
+    }
+
+    struct stat St;
+    Stats.TraceBytes = stat(Trace.c_str(), &St) == 0 ? (double)St.st_size : 0;
+    readTraceCounts(Trace, Stats);
+    removeDirectory(Dir);
+
+    if (!WIFEXITED(Status) || WEXITSTATUS(Status) != 0) {
+        Error = Path + (WIFSIGNALED(Status) ? " was killed by signal " + std::to_string(WTERMSIG(Status))
+                                            : " exited with status " + std::to_string(WEXITSTATUS(Status)));
+        return false;
+    }
+    return true;
+}
+
+static std::vector<std::string> split(const std::string &List) {
+    std::vector<std::string> Items;
+    size_t Begin = 0;
+    while (Begin <= List.size()) {
+        size_t End = List.find(',', Begin);
+        if (End == std::string::npos) End = List.size();
+        if (End > Begin) Items.push_back(List.substr(Begin, End - Begin));
+        Begin = End + 1;
+    }
+    return Items;
+}
+
+static double ratio(double Instrumented, double Plain) { return Plain > 0 ? Instrumented / Plain : 0; }
+
+static void printMeasurement(FILE *Out, const char *Key, const Measurement &M, const std::vector<std::string> &Events,
+                             bool Trace) {
+    fprintf(Out, "      \"%s\": { \"wall_s\": %.6f, \"user_s\": %.6f, \"sys_s\": %.6f, \"max_rss_kb\": %.0f", Key,
+            M.median(&RunStats::WallS), M.median(&RunStats::UserS), M.median(&RunStats::SysS),
+            M.median(&RunStats::MaxRssKb));
+    if (Trace) {
+        fprintf(Out, ", \"trace_bytes\": %.0f, \"records\": %.0f, \"dropped\": %.0f", M.median(&RunStats::TraceBytes),
+                M.median(&RunStats::Records), M.median(&RunStats::Dropped));
+    }
+    for (size_t I = 0; I < Events.size(); ++I) {
+        double Count = M.medianCount(I);
+        if (Count >= 0) fprintf(Out, ", \"%s\": %.0f", Events[I].c_str(), Count);
+    }
+    fprintf(Out, " },\n");
+}
+
+static int usage(const char *Argv0) {
+    fprintf(stderr, "usage: %s [-d dir] [-r runs] [-e events] [-o out.json] [workload...]\n", Argv0);
+    return 1;
+}
+
+int main(int argc, const char **argv) {
+    std::string Dir = CDLAB_BENCH_WORKLOAD_DIR;
+    int Runs = 5;
+    std::string EventList = "PAPI_TOT_INS,PAPI_TOT_CYC";
+    const char *Output = nullptr;
+    std::vector<std::string> Workloads;
+    for (int I = 1; I < argc; ++I) {
+        if (strcmp(argv[I], "-d") == 0 && I + 1 < argc) {
+            Dir = argv[++I];
+        } else if (strcmp(argv[I], "-r") == 0 && I + 1 < argc) {
+            Runs = atoi(argv[++I]);
+        } else if (strcmp(argv[I], "-e") == 0 && I + 1 < argc) {
+            EventList = argv[++I];
+        } else if (strcmp(argv[I], "-o") == 0 && I + 1 < argc) {
+            Output = argv[++I];
+        } else if (argv[I][0] == '-') {
+            return usage(argv[0]);
+        } else {
+            Workloads.push_back(argv[I]);
+        }
+    }
+    if (Runs < 1) return usage(argv[0]);
+    if (Workloads.empty()) Workloads = split(CDLAB_BENCH_WORKLOADS);
+
+    std::vector<std::string> Events;
+    std::vector<int> Codes;
+    if (EventList != "none") {
+        if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
+            fprintf(stderr, "cd_lab_bench: PAPI init failed\n");
+            return 1;
+        }
+        for (const std::string &Name : split(EventList)) {
+            int Code;
+            if (PAPI_event_name_to_code(Name.c_str(), &Code) != PAPI_OK) {
+                fprintf(stderr, "cd_lab_bench: invalid PAPI event name: %s\n", Name.c_str());
+                return 1;
+            }
+            Events.push_back(Name);
+            Codes.push_back(Code);
+        }
+    }
+
+    FILE *Out = Output ? fopen(Output, "w") : stdout;
+    if (!Out) {
+        fprintf(stderr, "cd_lab_bench: cannot write %s: %s\n", Output, strerror(errno));
+        return 1;
+    }
+
+    bool Failed = false;
+    fprintf(Out, "{\n  \"benchmark\": \"workloads\",\n  \"runs\": %d,\n  \"workloads\": [", Runs);
+    for (size_t W = 0; W < Workloads.size(); ++W) {
+        const std::string &Name = Workloads[W];
+        Measurement Plain, Instrumented;
+        std::string Error;
+        for (int R = 0; R < Runs && Error.empty(); ++R) {
+            RunStats PlainStats, InstrumentedStats;
+            if (runOnce(Dir + "/" + Name, Codes, PlainStats, Error)) Plain.Runs.push_back(PlainStats);
+            if (Error.empty() && runOnce(Dir + "/" + Name + "_instrumented", Codes, InstrumentedStats, Error)) {
+                Instrumented.Runs.push_back(InstrumentedStats);
+            }
+        }
+        // Counting may have been given up on during the runs.
+        if (Codes.empty()) Events.clear();
+
+        fprintf(Out, "%s\n    {\n      \"name\": \"%s\",\n", W ? "," : "", Name.c_str());
+        if (!Error.empty()) {
+            fprintf(stderr, "cd_lab_bench: %s\n", Error.c_str());
+            fprintf(Out, "      \"error\": \"run failed\"\n    }");
+            Failed = true;
+            continue;
+        }
+        printMeasurement(Out, "plain", Plain, Events, false);
+        printMeasurement(Out, "instrumented", Instrumented, Events, true);
+
+        double Slowdown = ratio(Instrumented.median(&RunStats::WallS), Plain.median(&RunStats::WallS));
+        fprintf(Out, "      \"slowdown\": %.3f,\n      \"rss_ratio\": %.3f", Slowdown,
+                ratio(Instrumented.median(&RunStats::MaxRssKb), Plain.median(&RunStats::MaxRssKb)));
+        for (size_t I = 0; I < Events.size(); ++I) {
+            fprintf(Out, ",\n      \"%s_ratio\": %.3f", Events[I].c_str(),
+                    ratio(Instrumented.medianCount(I), Plain.medianCount(I)));
+        }
+        fprintf(Out, "\n    }");
+        fprintf(stderr, "%-16s %7.2fx slower, %7.2fx memory, %10.0f trace bytes", Name.c_str(), Slowdown,
+                ratio(Instrumented.median(&RunStats::MaxRssKb), Plain.median(&RunStats::MaxRssKb)),
+                Instrumented.median(&RunStats::TraceBytes));
+        double Dropped = Instrumented.median(&RunStats::Dropped);
+        if (Dropped > 0) {
+            fprintf(stderr, "  (%.0f of %.0f records dropped: understated)", Dropped,
+                    Dropped + Instrumented.median(&RunStats::Records));
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(Out, "\n  ]\n}\n");
+    if (Out != stdout) fclose(Out);
+    if (!Events.empty()) PAPI_shutdown();
+    return Failed ? 1 : 0;
+}
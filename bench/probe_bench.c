@@ -0,0 +1,253 @@
+// cd_lab_probe_bench: what one instrumented call costs.
+//
+//   cd_lab_probe_bench [-t threads] [-n calls] [-r repeats] [-e events]... [-o out.json]
+//
+// Times a loop over an empty function with and without an entry/exit probe
+// pair and reports the difference per call, with no events, 2 events and 4
+// events (or each -e list instead, `none` for no events), on one thread and
+// on `threads` threads at once. The runtime reads its environment once per
+// process, so every configuration runs in a child of its own. Each thread
+// keeps the fastest of `repeats` timed loops. Records the writer could not
+// keep up with are dropped, which is cheaper than recording them, so each
+// result says how many of the child's records were dropped.
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "runtime.h"
+#include "trace_format.h"
+
+#define MAX_CONFIGS 16
+#define MAX_THREADS 256
+#define WARMUP_CALLS 100000
+
+static const char* const default_events[] = {
+    "none",
+    "PAPI_TOT_INS,PAPI_TOT_CYC",
+    "PAPI_TOT_INS,PAPI_TOT_CYC,PAPI_L1_DCM,PAPI_BR_MSP",
+};
+
+typedef struct {
+    double probe_ns;  // per call, over the uninstrumented loop
+    double bare_ns;
+    uint64_t records;  // written to the trace, and dropped
+    uint64_t dropped;
+} Result;
+
+typedef struct {
+    uint64_t calls;
+    int repeats;
+    pthread_barrier_t* start;
+    Result result;
+} Worker;
+
+// What the instrumentor would emit for this file.
+static const RuntimeFunctionInfo bench_functions[1] = {
+    { "probed", "probed", __FILE__, 0, "", RUNTIME_KIND_FUNCTION },
+};
+static uint32_t bench_ids[1];
+
+__attribute__((constructor(101))) static void register_functions(void) {
+    runtime_register_functions(bench_functions, 1, bench_ids);
+}
+
+__attribute__((noinline)) static void bare(void) {
+    __asm__ volatile("");
+}
+
+__attribute__((noinline)) static void probed(void) {
+    RUNTIME_SCOPE(bench_ids[0]);
+    __asm__ volatile("");
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t time_loop(void (*fn)(void), uint64_t calls) {
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < calls; ++i) fn();
+    return now_ns() - start;
+}
+
+static void* run_worker(void* arg) {
+    Worker* w = arg;
+    // Sets up the thread's state, and on the first thread calibrates.
+    time_loop(probed, WARMUP_CALLS);
+    pthread_barrier_wait(w->start);
+
+    uint64_t best_bare = UINT64_MAX, best_probed = UINT64_MAX;
+    for (int r = 0; r < w->repeats; ++r) {
+        uint64_t t = time_loop(bare, w->calls);
+        if (t < best_bare) best_bare = t;
+        t = time_loop(probed, w->calls);
+        if (t < best_probed) best_probed = t;
+    }
+    w->result.bare_ns = (double)best_bare / (double)w->calls;
+    w->result.probe_ns = ((double)best_probed - (double)best_bare) / (double)w->calls;
+    return NULL;
+}
+
+static Result run_config(int threads, uint64_t calls, int repeats) {
+    Worker workers[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, (unsigned)threads);
+
+    for (int t = 0; t < threads; ++t) {
+        workers[t] = (Worker){ calls, repeats, &start, { 0, 0, 0, 0 } };
+        pthread_create(&ids[t], NULL, run_worker, &workers[t]);
+    }
+    Result mean = { 0, 0, 0, 0 };
+    for (int t = 0; t < threads; ++t) {
+        pthread_join(ids[t], NULL);
+        mean.probe_ns += workers[t].result.probe_ns / threads;
+        mean.bare_ns += workers[t].result.bare_ns / threads;
+    }
+    pthread_barrier_destroy(&start);
+    return mean;
+}
+
+// Reads the record counts from the END block that closes a trace. Returns
+// -1 if the trace was not closed cleanly.
+static int read_trace_counts(const char* path, uint64_t* records, uint64_t* dropped) {
+    uint8_t end[TRACE_BLOCK_HEADER_SIZE + TRACE_END_PAYLOAD_SIZE];
+    FILE* f = fopen(path, "rb");
+    if (!f) return -1;
+    int ok = fseek(f, -(long)sizeof(end), SEEK_END) == 0 && fread(end, 1, sizeof(end), f) == sizeof(end) &&
+             trace_get_u32(end) == TRACE_BLOCK_END && trace_get_u32(end + 4) == TRACE_END_PAYLOAD_SIZE;
+    fclose(f);
+    if (!ok) return -1;
+    *records = trace_get_u64(end + TRACE_BLOCK_HEADER_SIZE + 8);
+    *dropped = trace_get_u64(end + TRACE_BLOCK_HEADER_SIZE + 16);
+    return 0;
+}
+
+// Runs one configuration in a child with its trace in a scratch directory.
+static int run_child(const char* events, int threads, uint64_t calls, int repeats, Result* result) {
+    char dir[] = "/tmp/cd_lab_probe_bench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    char trace[sizeof(dir) + 16];
+    snprintf(trace, sizeof(trace), "%s/probes.cdlt", dir);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        rmdir(dir);
+        return -1;
+    }
+    fflush(NULL);  // or the child flushes the parent's buffered output again
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        setenv("TRACE_PAPI_EVENTS", events, 1);
+        setenv("TRACE_OUTPUT", trace, 1);
+        Result r = run_config(threads, calls, repeats);
+        if (write(fds[1], &r, sizeof(r)) != sizeof(r)) _exit(1);
+        // A normal exit, so that the runtime shuts down as it would anyway.
+        exit(0);
+    }
+    close(fds[1]);
+
+    int status = 0;
+    ssize_t got = pid > 0 ? read(fds[0], result, sizeof(*result)) : -1;
+    close(fds[0]);
+    if (pid > 0) waitpid(pid, &status, 0);
+    int closed = read_trace_counts(trace, &result->records, &result->dropped);
+    unlink(trace);
+    rmdir(dir);
+    return got == (ssize_t)sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 && closed == 0 ? 0
+                                                                                                        : -1;
+}
+
+static int count_events(const char* events) {
+    if (strcmp(events, "none") == 0) return 0;
+    int n = 1;
+    for (const char* p = events; *p; ++p) n += *p == ',';
+    return n;
+}
+
+static int usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-t threads] [-n calls] [-r repeats] [-e events]... [-o out.json]\n", argv0);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 4 ? (int)cpus : 4;
+    uint64_t calls = 1000000;
+    int repeats = 5;
+    const char* output = NULL;
+    const char* events[MAX_CONFIGS];
+    int num_configs = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            calls = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc && num_configs < MAX_CONFIGS) {
+            events[num_configs++] = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || calls == 0 || repeats < 1) return usage(argv[0]);
+    if (num_configs == 0) {
+        num_configs = (int)(sizeof(default_events) / sizeof(default_events[0]));
+        memcpy(events, default_events, sizeof(default_events));
+    }
+
+    FILE* out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        perror(output);
+        return 1;
+    }
+
+    int thread_counts[2] = { 1, threads };
+    int failed = 0;
+    fprintf(out, "{\n  \"benchmark\": \"probes\",\n  \"calls\": %llu,\n  \"repeats\": %d,\n  \"results\": [",
+            (unsigned long long)calls, repeats);
+    for (int c = 0, first = 1; c < num_configs; ++c) {
+        for (int k = 0; k < (threads > 1 ? 2 : 1); ++k, first = 0) {
+            Result r;
+            int rc = run_child(events[c], thread_counts[k], calls, repeats, &r);
+            fprintf(out, "%s\n    { \"events\": \"%s\", \"num_events\": %d, \"threads\": %d, ", first ? "" : ",",
+                    events[c], count_events(events[c]), thread_counts[k]);
+            if (rc == 0) {
+                fprintf(out, "\"ns_per_call\": %.2f, \"bare_ns_per_call\": %.2f, \"records\": %llu, \"dropped\": %llu }",
+                        r.probe_ns, r.bare_ns, (unsigned long long)r.records, (unsigned long long)r.dropped);
+                fprintf(stderr, "%-52s %3d threads  %8.2f ns per call", events[c], thread_counts[k], r.probe_ns);
+                if (r.dropped > 0) {
+                    fprintf(stderr, "  (%llu of %llu records dropped: understated)",
+                            (unsigned long long)r.dropped, (unsigned long long)(r.records + r.dropped));
+                }
+                fprintf(stderr, "\n");
+            } else {
+                fprintf(out, "\"error\": \"configuration failed\" }");
+                fprintf(stderr, "%-52s %3d threads  failed\n", events[c], thread_counts[k]);
+                failed = 1;
+            }
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    return failed;
+}
@@ -0,0 +1,59 @@
+# Writes the fan-out workload to OUTPUT:
+#
+#   cmake -DOUTPUT=fanout.c -P fanout.cmake
+#
+# The leaves are written out rather than stamped from a C macro, because the
+# instrumentor leaves macro-expanded bodies alone.
+
+set(LEAVES 64)
+math(EXPR LAST "${LEAVES} - 1")
+
+set(C "// Wide fan-out: one dispatcher calls ${LEAVES} distinct small functions, 4M calls
+// in all, so every probe touches a different function's state. Generated by
+// bench/workloads/fanout.cmake.
+
+#include <stdio.h>
+
+#define ROUNDS 62500
+")
+
+foreach(I RANGE ${LAST})
+  math(EXPR ADD "${I} + 1")
+  string(APPEND C "
+__attribute__((noinline)) static unsigned leaf${I}(unsigned x) {
+    for (int i = 0; i < 4; ++i) x = x * 2654435761u + ${ADD};
+    return x;
+}
+")
+endforeach()
+
+string(APPEND C "\nstatic unsigned (*const leaves[${LEAVES}])(unsigned) = {")
+foreach(I RANGE ${LAST})
+  math(EXPR COLUMN "${I} % 8")
+  if(COLUMN EQUAL 0)
+    string(APPEND C "\n   ")
+  endif()
+  string(APPEND C " leaf${I},")
+endforeach()
+
+string(APPEND C "
+};
+
+__attribute__((noinline)) static unsigned dispatch(unsigned x) {
+    for (int i = 0; i < ${LEAVES}; ++i) {
+        x = leaves[(x >> 7 ^ i) & ${LAST}](x);
+    }
+    return x;
+}
+
+int main(void) {
+    unsigned x = 1;
+    for (int r = 0; r < ROUNDS; ++r) {
+        x = dispatch(x);
+    }
+    printf(\"%u\\n\", x);
+    return 0;
+}
+")
+
+file(WRITE ${OUTPUT} "${C}")
@@ -0,0 +1,13 @@
+// Millions of calls of mixed size: naive Fibonacci makes 7M calls, most of
+// them short.
+
+#include <stdio.h>
+
+__attribute__((noinline)) static long fib(int n) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+int main(void) {
+    printf("%ld\n", fib(32));
+    return 0;
+}
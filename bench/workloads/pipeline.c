@@ -0,0 +1,70 @@
+// Multithreaded pipeline: four stages connected by bounded queues, each on
+// its own thread, passing 200k items with instrumented work at every stage.
+
+#include <pthread.h>
+#include <stdio.h>
+
+#define ITEMS 200000
+#define STAGES 4
+#define QUEUE_SIZE 256
+
+typedef struct {
+    long items[QUEUE_SIZE];
+    unsigned head, tail;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} Queue;
+
+static Queue queues[STAGES + 1];
+
+static void queue_push(Queue* q, long item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->tail - q->head == QUEUE_SIZE) pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[q->tail++ % QUEUE_SIZE] = item;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static long queue_pop(Queue* q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->tail == q->head) pthread_cond_wait(&q->not_empty, &q->lock);
+    long item = q->items[q->head++ % QUEUE_SIZE];
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+__attribute__((noinline)) static long transform(long item, int stage) {
+    for (int i = 0; i < 64; ++i) item = item * 6364136223846793005l + stage;
+    return item;
+}
+
+static void* run_stage(void* arg) {
+    int stage = (int)(long)arg;
+    for (int i = 0; i < ITEMS; ++i) {
+        queue_push(&queues[stage + 1], transform(queue_pop(&queues[stage]), stage));
+    }
+    return NULL;
+}
+
+int main(void) {
+    for (int s = 0; s <= STAGES; ++s) {
+        pthread_mutex_init(&queues[s].lock, NULL);
+        pthread_cond_init(&queues[s].not_empty, NULL);
+        pthread_cond_init(&queues[s].not_full, NULL);
+    }
+
+    pthread_t threads[STAGES];
+    for (long s = 0; s < STAGES; ++s) pthread_create(&threads[s], NULL, run_stage, (void*)s);
+
+    long sum = 0;
+    for (int i = 0; i < ITEMS; ++i) {
+        queue_push(&queues[0], i);
+        // Keep the feeder at most one queue ahead of the last stage.
+        if (i >= QUEUE_SIZE) sum += queue_pop(&queues[STAGES]);
+    }
+    for (int i = 0; i < QUEUE_SIZE; ++i) sum += queue_pop(&queues[STAGES]);
+    for (int s = 0; s < STAGES; ++s) pthread_join(threads[s], NULL);
+    printf("%ld\n", sum);
+    return 0;
+}
@@ -0,0 +1,20 @@
+// Deep recursion: 2M calls on a shadow stack 400 frames deep.
+
+#include <stdio.h>
+
+#define DEPTH 400
+#define DESCENTS 5000
+
+__attribute__((noinline)) static long descend(int depth, long acc) {
+    if (depth == 0) return acc;
+    return descend(depth - 1, acc ^ (acc << 1 | depth)) + 1;
+}
+
+int main(void) {
+    long sum = 0;
+    for (int i = 0; i < DESCENTS; ++i) {
+        sum += descend(DEPTH, i);
+    }
+    printf("%ld\n", sum);
+    return 0;
+}
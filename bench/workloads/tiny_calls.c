@@ -0,0 +1,19 @@
+// Tight loop over a tiny function: 10M calls that each do almost nothing,
+// so the probes are nearly all of the instrumented run time.
+
+#include <stdio.h>
+
+#define CALLS 10000000
+
+__attribute__((noinline)) static unsigned step(unsigned x) {
+    return x * 1664525u + 1013904223u;
+}
+
+int main(void) {
+    unsigned x = 0;
+    for (int i = 0; i < CALLS; ++i) {
+        x = step(x);
+    }
+    printf("%u\n", x);
+    return 0;
+}
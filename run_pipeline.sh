@@ -4,6 +4,7 @@
 INPUT_FILE=""
 EVENTS=""
 OUTPUT_FILE="function_metrics.csv"  # default fallback
+OPT_LEVEL="-O2"
 
 while [[ "$#" -gt 0 ]]; do
     case $1 in
@@ -19,9 +20,13 @@ while [[ "$#" -gt 0 ]]; do
             OUTPUT_FILE="$2"
             shift 2
             ;;
+        -O|--opt)
+            OPT_LEVEL="-O$2"
+            shift 2
+            ;;
         *)
             echo "❌ Unknown parameter: $1"
-            echo "Usage: $0 -i <input_file.c> -e <PAPI_EVENTS> [-o output.csv]"
+            echo "Usage: $0 -i <input_file.c> -e <PAPI_EVENTS> [-o output.csv] [-O level]"
             exit 1
             ;;
     esac
@@ -30,7 +35,7 @@ done
 # ----------- Validate Inputs ----------------
 if [[ -z "$INPUT_FILE" || -z "$EVENTS" ]]; then
     echo "❌ Missing input file or events."
-    echo "Usage: $0 -i <input_file.c> -e <PAPI_EVENTS> [-o output.csv]"
+    echo "Usage: $0 -i <input_file.c> -e <PAPI_EVENTS> [-o output.csv] [-O level]"
     exit 1
 fi
 
@@ -49,8 +54,8 @@ if [[ $? -ne 0 ]]; then
 fi
 
 # ----------- Step 2: Compile Instrumented Code ----------------
-echo "⚙️  Compiling $INSTRUMENTED into $EXECUTABLE"
-gcc -O0 -o "$EXECUTABLE" "$INSTRUMENTED" runtime/runtime.c -Iruntime -lpapi -lrt -g -pthread
+echo "⚙️  Compiling $INSTRUMENTED into $EXECUTABLE ($OPT_LEVEL)"
+gcc "$OPT_LEVEL" -o "$EXECUTABLE" "$INSTRUMENTED" runtime/*.c -Iruntime -lpapi -lrt -g -pthread
 
 if [[ $? -ne 0 ]]; then
     echo "❌ Compilation failed."
@@ -66,10 +71,14 @@ if [[ $? -ne 0 ]]; then
     exit 1
 fi
 
-# ----------- Step 4: Handle Output ----------------
-if [[ -f "function_metrics.csv" ]]; then
-    mv function_metrics.csv "$OUTPUT_FILE"
+# ----------- Step 4: Convert Trace ----------------
+if [[ -f "function_metrics.cdlt" ]]; then
+    ./build/analysis/cd_lab_trace csv function_metrics.cdlt -o "$OUTPUT_FILE" || exit 1
     echo "✅ CSV output written to: $OUTPUT_FILE"
+    FUNCTIONS_FILE="${OUTPUT_FILE%.csv}_functions.csv"
+    ./build/analysis/cd_lab_trace functions function_metrics.cdlt -o "$FUNCTIONS_FILE" || exit 1
+    echo "✅ Function table written to: $FUNCTIONS_FILE"
+    echo "ℹ️  Raw trace kept in function_metrics.cdlt"
 else
-    echo "⚠️ No CSV output file generated."
+    echo "⚠️ No trace file generated."
 fi
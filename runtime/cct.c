@@ -0,0 +1,326 @@
+#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
+
+#include "cct.h"
+#include "functions.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CCT_BLOCK_SIZE (64 * 1024)
+#define CCT_INITIAL_CHILDREN 4
+
+struct CctBlock {
+    struct CctBlock* next;
+    _Alignas(16) uint8_t data[];
+};
+
+// One caller/callee pair in one context, gathered for the edge table.
+typedef struct {
+    uint32_t caller;
+    uint32_t callee;
+    const CctNode* node;
+} CctEdge;
+
+int cct_enabled = 0;
+
+static const char* output_prefix = "function_metrics";
+static CctTree merged;
+static int merged_ready = 0;
+static pthread_mutex_t merged_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cct_init(void) {
+    const char* env = getenv("TRACE_CCT");
+    cct_enabled = env && atoi(env) > 0;
+
+    env = getenv("TRACE_CCT_PREFIX");
+    if (env && strlen(env) > 0) {
+        output_prefix = env;
+    }
+}
+
+void cct_tree_init(CctTree* tree) {
+    memset(tree, 0, sizeof(*tree));
+    tree->root.func_id = CCT_ROOT_ID;
+}
+
+static void* arena_alloc(CctTree* tree, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if ((size_t)(tree->limit - tree->cursor) < size) {
+        size_t capacity = size > CCT_BLOCK_SIZE ? size : CCT_BLOCK_SIZE;
+        CctBlock* block = malloc(sizeof(CctBlock) + capacity);
+        if (!block) {
+            fprintf(stderr, "Failed to allocate calling-context tree\n");
+            exit(1);
+        }
+        block->next = tree->blocks;
+        tree->blocks = block;
+        tree->cursor = block->data;
+        tree->limit = block->data + capacity;
+    }
+    void* p = tree->cursor;
+    tree->cursor += size;
+    memset(p, 0, size);
+    return p;
+}
+
+static void arena_free(CctTree* tree) {
+    CctBlock* block = tree->blocks;
+    while (block) {
+        CctBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    cct_tree_init(tree);
+}
+
+static void table_put(CctNode** table, uint32_t mask, CctNode* child) {
+    uint32_t slot = cct_hash(child->func_id) & mask;
+    while (table[slot]) slot = (slot + 1) & mask;
+    table[slot] = child;
+}
+
+CctNode* cct_insert(CctTree* tree, CctNode* parent, uint32_t func_id) {
+    uint32_t capacity = parent->child_mask ? parent->child_mask + 1 : 0;
+    // Keep the table at most 3/4 full so probes stay short. The old table is
+    // left in the arena.
+    if (4 * (parent->num_children + 1) > 3 * capacity) {
+        uint32_t grown = capacity ? 2 * capacity : CCT_INITIAL_CHILDREN;
+        CctNode** table = arena_alloc(tree, grown * sizeof(CctNode*));
+        for (uint32_t i = 0; i < capacity; ++i) {
+            if (parent->children[i]) table_put(table, grown - 1, parent->children[i]);
+        }
+        parent->children = table;
+        parent->child_mask = grown - 1;
+    }
+
+    CctNode* child = arena_alloc(tree, sizeof(CctNode));
+    child->func_id = func_id;
+    table_put(parent->children, parent->child_mask, child);
+    parent->num_children++;
+    return child;
+}
+
+static void merge_node(CctNode* into, const CctNode* from) {
+    into->calls += from->calls;
+    into->measured += from->measured;
+    into->ns += from->ns;
+    into->self_ns += from->self_ns;
+    into->trips += from->trips;
+    for (int i = 0; i < num_events; ++i) {
+        into->counts[i] += from->counts[i];
+        into->self_counts[i] += from->self_counts[i];
+    }
+    for (int g = 0; g < num_groups; ++g) {
+        into->running_ns[g] += from->running_ns[g];
+    }
+    for (uint32_t i = 0; from->child_mask && i <= from->child_mask; ++i) {
+        const CctNode* c = from->children[i];
+        if (c) merge_node(cct_child(&merged, into, c->func_id), c);
+    }
+}
+
+void cct_collect(CctTree* tree, int release) {
+    pthread_mutex_lock(&merged_lock);
+    if (!merged_ready) {
+        cct_tree_init(&merged);
+        merged_ready = 1;
+    }
+    merge_node(&merged.root, &tree->root);
+    pthread_mutex_unlock(&merged_lock);
+
+    if (release) arena_free(tree);
+}
+
+// Frame name as flame graph tools expect it: no ';', which separates frames.
+static void write_frame(FILE* out, uint32_t id) {
+    const RuntimeFunctionInfo* info = functions_get(id);
+    if (info->kind == RUNTIME_KIND_FUNCTION && info->scope[0]) {
+        for (const char* p = info->scope; *p; ++p) fputc(*p == ';' ? ':' : *p, out);
+        fputs("::", out);
+    }
+    for (const char* p = info->name; *p; ++p) fputc(*p == ';' ? ':' : *p, out);
+}
+
+// Value of `node` for the metric with this index: -2 calls, -1 time, or an
+// event. Calls are per context; time and events are the node's inclusive
+// cost minus that of its children, so that a flame graph adds them back up.
+// Rotated events are scaled per node before the subtraction.
+static long long metric_inclusive(const CctNode* node, int metric) {
+    if (metric == -1) return (long long)node->ns;
+    return event_estimate(metric, node->counts[metric], node->ns, node->running_ns);
+}
+
+static long long metric_value(const CctNode* node, int metric) {
+    if (metric == -2) return (long long)node->calls;
+    long long v = metric_inclusive(node, metric);
+    for (uint32_t i = 0; node->child_mask && i <= node->child_mask; ++i) {
+        if (node->children[i]) v -= metric_inclusive(node->children[i], metric);
+    }
+    return v > 0 ? v : 0;
+}
+
+static void write_folded_node(FILE* out, const CctNode* node, const CctNode** path, int depth, int metric) {
+    if (node->func_id != CCT_ROOT_ID) {
+        path[depth++] = node;
+        long long v = metric_value(node, metric);
+        if (v > 0) {
+            for (int i = 0; i < depth; ++i) {
+                if (i > 0) fputc(';', out);
+                write_frame(out, path[i]->func_id);
+            }
+            fprintf(out, " %lld\n", v);
+        }
+    }
+    for (uint32_t i = 0; node->child_mask && i <= node->child_mask; ++i) {
+        if (node->children[i]) write_folded_node(out, node->children[i], path, depth, metric);
+    }
+}
+
+static uint32_t tree_depth(const CctNode* node) {
+    uint32_t deepest = 0;
+    for (uint32_t i = 0; node->child_mask && i <= node->child_mask; ++i) {
+        if (node->children[i]) {
+            uint32_t d = tree_depth(node->children[i]);
+            if (d > deepest) deepest = d;
+        }
+    }
+    return deepest + 1;
+}
+
+static void write_folded(const char* metric_name, int metric, uint32_t depth) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.%s.folded", output_prefix, metric_name);
+    for (char* p = path + strlen(output_prefix) + 1; *p; ++p) {
+        if (*p == '/') *p = '_';
+    }
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return;
+    }
+    const CctNode** frames = malloc(depth * sizeof(CctNode*));
+    if (frames) {
+        write_folded_node(out, &merged.root, frames, 0, metric);
+        free(frames);
+    }
+    fclose(out);
+}
+
+static size_t collect_edges(const CctNode* node, CctEdge* edges, size_t n) {
+    for (uint32_t i = 0; node->child_mask && i <= node->child_mask; ++i) {
+        const CctNode* c = node->children[i];
+        if (!c) continue;
+        edges[n].caller = node->func_id;
+        edges[n].callee = c->func_id;
+        edges[n].node = c;
+        n = collect_edges(c, edges, n + 1);
+    }
+    return n;
+}
+
+static size_t count_nodes(const CctNode* node) {
+    size_t n = node->num_children;
+    for (uint32_t i = 0; node->child_mask && i <= node->child_mask; ++i) {
+        if (node->children[i]) n += count_nodes(node->children[i]);
+    }
+    return n;
+}
+
+static int compare_edges(const void* a, const void* b) {
+    const CctEdge* x = a;
+    const CctEdge* y = b;
+    if (x->caller != y->caller) return x->caller < y->caller ? -1 : 1;
+    if (x->callee != y->callee) return x->callee < y->callee ? -1 : 1;
+    return 0;
+}
+
+static void write_csv_name(FILE* out, uint32_t id) {
+    if (id == CCT_ROOT_ID) return;
+    const RuntimeFunctionInfo* info = functions_get(id);
+    fputc('"', out);
+    if (info->kind == RUNTIME_KIND_FUNCTION && info->scope[0]) fprintf(out, "%s::", info->scope);
+    fprintf(out, "%s\"", info->name);
+}
+
+// One row per caller/callee pair, summed over every context it occurs in.
+// Calls made from outside any instrumented function have an empty caller.
+static void write_edges(void) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.edges.csv", output_prefix);
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return;
+    }
+
+    size_t count = count_nodes(&merged.root);
+    CctEdge* edges = malloc((count ? count : 1) * sizeof(CctEdge));
+    if (!edges) {
+        fclose(out);
+        return;
+    }
+    count = collect_edges(&merged.root, edges, 0);
+    qsort(edges, count, sizeof(CctEdge), compare_edges);
+
+    fprintf(out, "caller_id,caller,callee_id,callee,calls,measured,total_ns,self_ns");
+    for (int i = 0; i < num_events; ++i) {
+        fprintf(out, ",%s,%s_self", event_names[i], event_names[i]);
+    }
+    fprintf(out, "\n");
+
+    for (size_t i = 0; i < count;) {
+        CctNode sum = { 0 };
+        size_t j = i;
+        for (; j < count && compare_edges(&edges[i], &edges[j]) == 0; ++j) {
+            const CctNode* n = edges[j].node;
+            sum.calls += n->calls;
+            sum.measured += n->measured;
+            sum.ns += n->ns;
+            sum.self_ns += n->self_ns;
+            for (int e = 0; e < num_events; ++e) {
+                sum.counts[e] += n->counts[e];
+                sum.self_counts[e] += n->self_counts[e];
+            }
+            for (int g = 0; g < num_groups; ++g) {
+                sum.running_ns[g] += n->running_ns[g];
+            }
+        }
+
+        if (edges[i].caller != CCT_ROOT_ID) fprintf(out, "%u", edges[i].caller);
+        fputc(',', out);
+        write_csv_name(out, edges[i].caller);
+        fprintf(out, ",%u,", edges[i].callee);
+        write_csv_name(out, edges[i].callee);
+        fprintf(out, ",%llu,%llu,%llu,%llu", (unsigned long long)sum.calls, (unsigned long long)sum.measured,
+                (unsigned long long)sum.ns, (unsigned long long)sum.self_ns);
+        for (int e = 0; e < num_events; ++e) {
+            fprintf(out, ",%lld,%lld", event_estimate(e, sum.counts[e], sum.ns, sum.running_ns),
+                    event_estimate(e, sum.self_counts[e], sum.ns, sum.running_ns));
+        }
+        fprintf(out, "\n");
+        i = j;
+    }
+
+    free(edges);
+    fclose(out);
+}
+
+void cct_shutdown(void) {
+    if (!cct_enabled) return;
+
+    pthread_mutex_lock(&merged_lock);
+    if (!merged_ready) {
+        cct_tree_init(&merged);
+        merged_ready = 1;
+    }
+    uint32_t depth = tree_depth(&merged.root);
+    write_folded("time_ns", -1, depth);
+    write_folded("calls", -2, depth);
+    for (int i = 0; i < num_events; ++i) {
+        write_folded(event_names[i], i, depth);
+    }
+    write_edges();
+    pthread_mutex_unlock(&merged_lock);
+}
@@ -0,0 +1,94 @@
+// runtime/cct.h
+//
+// Per-thread calling-context trees. Each node is one (calling context,
+// function) pair and accumulates the cost of the calls made in that context.
+// A node finds its children through a small open-addressing table keyed by
+// function ID. Nodes and tables come from a per-thread arena that is freed
+// as a whole once the thread's tree has been merged into the process tree,
+// which is written out at exit as folded stacks and a caller/callee table.
+
+#ifndef CCT_H
+#define CCT_H
+
+#include <stdint.h>
+
+#include "runtime_internal.h"
+#include "trace_buffer.h"
+
+#define CCT_ROOT_ID UINT32_MAX
+
+typedef struct CctNode {
+    uint32_t func_id;
+    uint32_t child_mask;        // table size - 1; 0 until the first child
+    uint32_t num_children;
+    struct CctNode** children;  // open-addressing table, NULL slots empty
+    uint64_t calls;             // entries, measured or not
+    uint64_t measured;
+    uint64_t ns;                // inclusive, probe overhead removed
+    uint64_t self_ns;           // as in the trace records
+    uint64_t trips;
+    long long counts[MAX_EVENTS];
+    long long self_counts[MAX_EVENTS];
+    uint64_t running_ns[MAX_GROUPS];  // with rotation, see counters.h
+} CctNode;
+
+typedef struct CctBlock CctBlock;
+
+typedef struct {
+    CctNode root;
+    CctBlock* blocks;
+    uint8_t* cursor;
+    uint8_t* limit;
+} CctTree;
+
+// Set from TRACE_CCT by cct_init().
+extern int cct_enabled;
+
+void cct_init(void);
+void cct_tree_init(CctTree* tree);
+
+// Slow path of cct_child(): adds the child, growing the table if needed.
+CctNode* cct_insert(CctTree* tree, CctNode* parent, uint32_t func_id);
+
+static inline uint32_t cct_hash(uint32_t func_id) {
+    uint32_t h = func_id * 2654435761u;
+    return h ^ (h >> 15);
+}
+
+static inline CctNode* cct_child(CctTree* tree, CctNode* parent, uint32_t func_id) {
+    if (parent->child_mask) {
+        uint32_t slot = cct_hash(func_id) & parent->child_mask;
+        CctNode* c;
+        while ((c = parent->children[slot]) != NULL) {
+            if (c->func_id == func_id) return c;
+            slot = (slot + 1) & parent->child_mask;
+        }
+    }
+    return cct_insert(tree, parent, func_id);
+}
+
+// Adds one measured call, given as the record the trace got.
+static inline void cct_add(CctNode* node, const TraceRecord* r) {
+    node->measured++;
+    node->ns += r->ns;
+    node->self_ns += r->self_ns;
+    node->trips += r->trips;
+    for (int i = 0; i < num_events; ++i) {
+        node->counts[i] += r->counters[i];
+        node->self_counts[i] += r->self_counters[i];
+    }
+    if (multiplex_mode == MULTIPLEX_ROTATE) {
+        for (int g = 0; g < num_groups; ++g) node->running_ns[g] += r->running_ns[g];
+    }
+}
+
+// Merges a thread's tree into the process tree. With `release`, the
+// thread's arena is freed; the tree must not be used again until
+// cct_tree_init().
+void cct_collect(CctTree* tree, int release);
+
+// Writes the merged tree: <prefix>.<metric>.folded for time_ns, calls and
+// each event, and <prefix>.edges.csv.
+void cct_shutdown(void);
+
+#endif // CCT_H
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+
+#include "counters.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_SLICE_US 10000
+
+int num_events = 0;
+char* event_names[MAX_EVENTS];  // char* instead of const char* for strdup
+static int event_codes[MAX_EVENTS];
+
+int num_groups = 1;
+int event_group[MAX_EVENTS];
+int multiplex_mode = MULTIPLEX_NONE;
+static int event_slot[MAX_EVENTS];  // position within its group's event set
+static int group_size[MAX_GROUPS];
+static int group_codes[MAX_GROUPS][MAX_EVENTS];
+static uint64_t slice_ns = DEFAULT_SLICE_US * 1000ull;
+
+static unsigned long papi_thread_id(void) {
+    return (unsigned long)pthread_self();
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// First fit: each event joins the first group whose event set accepts it,
+// or opens a new group when none does.
+static void partition_events(void) {
+    int sets[MAX_GROUPS];
+    num_groups = 0;
+
+    for (int i = 0; i < num_events; ++i) {
+        int g = 0;
+        for (; g < num_groups; ++g) {
+            if (PAPI_add_event(sets[g], event_codes[i]) == PAPI_OK) break;
+        }
+        if (g == num_groups) {
+            int rc = PAPI_ENOEVNT;
+            if (num_groups == MAX_GROUPS) {
+                fprintf(stderr, "Events need more than %d counter groups: %s\n", MAX_GROUPS, event_names[i]);
+                exit(1);
+            }
+            sets[g] = PAPI_NULL;
+            if ((rc = PAPI_create_eventset(&sets[g])) != PAPI_OK ||
+                (rc = PAPI_add_event(sets[g], event_codes[i])) != PAPI_OK) {
+                fprintf(stderr, "PAPI event %s cannot be counted: %s\n", event_names[i], PAPI_strerror(rc));
+                exit(1);
+            }
+            num_groups++;
+        }
+        event_group[i] = g;
+        event_slot[i] = group_size[g];
+        group_codes[g][group_size[g]++] = event_codes[i];
+    }
+
+    for (int g = 0; g < num_groups; ++g) {
+        PAPI_cleanup_eventset(sets[g]);
+        PAPI_destroy_eventset(&sets[g]);
+    }
+    if (num_groups == 0) num_groups = 1;
+}
+
+static void init_multiplexing(void) {
+    partition_events();
+    if (num_groups == 1) return;
+
+    multiplex_mode = MULTIPLEX_ROTATE;
+    const char* env = getenv("TRACE_MULTIPLEX_SLICE_US");
+    if (env && atol(env) > 0) {
+        slice_ns = (uint64_t)atol(env) * 1000ull;
+    }
+    fprintf(stderr, "cd-lab: %d events in %d counter groups, rotated per thread\n", num_events, num_groups);
+}
+
+void counters_init(void) {
+    if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
+        fprintf(stderr, "PAPI init failed!\n");
+        exit(1);
+    }
+
+    if (PAPI_thread_init(papi_thread_id) != PAPI_OK) {
+        fprintf(stderr, "PAPI thread init failed!\n");
+        exit(1);
+    }
+
+    const char* env = getenv("TRACE_PAPI_EVENTS");
+    if (env && strcmp(env, "none") == 0) {
+        // Times only; every thread skips its event sets.
+        fprintf(stderr, "TRACE_PAPI_EVENTS = none\n");
+    } else if (env && strlen(env) > 0) {
+        fprintf(stderr, "TRACE_PAPI_EVENTS = %s\n", env);
+        char* env_copy = strdup(env);
+        char* token = strtok(env_copy, ",");
+        while (token) {
+            token[strcspn(token, "\n")] = 0; // remove newline
+            if (num_events == MAX_EVENTS) {
+                fprintf(stderr, "Too many PAPI events: at most %d (rebuild the runtime with -DMAX_EVENTS=n)\n",
+                        MAX_EVENTS);
+                exit(1);
+            }
+            event_names[num_events] = strdup(token);
+            if (PAPI_event_name_to_code(event_names[num_events], &event_codes[num_events]) != PAPI_OK) {
+                fprintf(stderr, "Invalid PAPI event name: %s\n", event_names[num_events]);
+                exit(1);
+            }
+            num_events++;
+            token = strtok(NULL, ",");
+        }
+        free(env_copy);
+    } else {
+        // fallback defaults
+        event_names[0] = strdup("PAPI_TOT_INS");
+        event_names[1] = strdup("PAPI_L1_DCM");
+        num_events = 2;
+        for (int i = 0; i < num_events; i++) {
+            if (PAPI_event_name_to_code(event_names[i], &event_codes[i]) != PAPI_OK) {
+                fprintf(stderr, "Error mapping default event: %s\n", event_names[i]);
+                exit(1);
+            }
+        }
+    }
+
+    init_multiplexing();
+}
+
+static void destroy_sets(ThreadCounters* tc) {
+    for (int g = 0; g < MAX_GROUPS; ++g) {
+        if (tc->event_sets[g] != PAPI_NULL) {
+            PAPI_cleanup_eventset(tc->event_sets[g]);
+            PAPI_destroy_eventset(&tc->event_sets[g]);
+        }
+    }
+}
+
+void counters_thread_start(ThreadCounters* tc) {
+    memset(tc, 0, sizeof(*tc));
+    for (int g = 0; g < MAX_GROUPS; ++g) tc->event_sets[g] = PAPI_NULL;
+    if (num_events == 0) return;
+
+    int rc = PAPI_register_thread();
+    if (rc != PAPI_OK) {
+        fprintf(stderr, "PAPI_register_thread failed: %s\n", PAPI_strerror(rc));
+        return;
+    }
+
+    // One set per group; without rotation that is one set of every event.
+    for (int g = 0; g < num_groups && rc == PAPI_OK; ++g) {
+        if ((rc = PAPI_create_eventset(&tc->event_sets[g])) != PAPI_OK) break;
+        rc = PAPI_add_events(tc->event_sets[g], group_codes[g], group_size[g]);
+    }
+    if (rc == PAPI_OK) rc = PAPI_start(tc->event_sets[0]);
+    if (rc != PAPI_OK) {
+        // Keep tracing times; counter columns read as zero for this thread.
+        fprintf(stderr, "Failed to start per-thread event set: %s\n", PAPI_strerror(rc));
+        destroy_sets(tc);
+        PAPI_unregister_thread();
+        return;
+    }
+    tc->active_since = now_ns();
+    tc->running = 1;
+}
+
+void counters_thread_stop(ThreadCounters* tc) {
+    if (!tc->running) return;
+    tc->running = 0;
+    PAPI_stop(tc->event_sets[tc->active], NULL);
+    destroy_sets(tc);
+    PAPI_unregister_thread();
+}
+
+// Moves the thread on to the next group. `counted` holds what the active
+// group counted since it started; the few events between that read and the
+// stop are lost.
+static void rotate(ThreadCounters* tc, const long long* counted, uint64_t now) {
+    for (int i = 0; i < num_events; ++i) {
+        if (event_group[i] == tc->active) tc->totals[i] += counted[event_slot[i]];
+    }
+    tc->group_ns[tc->active] += now - tc->active_since;
+
+    PAPI_stop(tc->event_sets[tc->active], NULL);
+    tc->active = (tc->active + 1) % num_groups;
+    // PAPI_start zeroes the counters of the set it starts.
+    PAPI_start(tc->event_sets[tc->active]);
+    tc->active_since = now_ns();
+}
+
+void counters_read_rotating(ThreadCounters* tc, long long* values, uint64_t* running) {
+    long long counted[MAX_EVENTS];
+    PAPI_read(tc->event_sets[tc->active], counted);
+    uint64_t now = now_ns();
+
+    for (int i = 0; i < num_events; ++i) {
+        values[i] = tc->totals[i] + (event_group[i] == tc->active ? counted[event_slot[i]] : 0);
+    }
+    for (int g = 0; g < num_groups; ++g) {
+        running[g] = tc->group_ns[g] + (g == tc->active ? now - tc->active_since : 0);
+    }
+
+    if (!tc->pinned && now - tc->active_since >= slice_ns) rotate(tc, counted, now);
+}
+
+void counters_pin_group(ThreadCounters* tc, int group) {
+    if (!tc->running || multiplex_mode != MULTIPLEX_ROTATE) return;
+    while (tc->active != group) {
+        long long counted[MAX_EVENTS];
+        PAPI_read(tc->event_sets[tc->active], counted);
+        rotate(tc, counted, now_ns());
+    }
+    tc->pinned = 1;
+}
+
+void counters_unpin(ThreadCounters* tc) {
+    tc->pinned = 0;
+}
@@ -0,0 +1,59 @@
+// runtime/counters.h
+//
+// Per-thread PAPI event sets. Every thread registers with PAPI and starts
+// its own event sets the first time it is seen; they then run until the
+// thread exits, so probes only ever read the counters.
+//
+// Events that cannot be counted together are split into groups. With
+// rotation, each thread counts one group at a time and moves to the next at
+// the first read after TRACE_MULTIPLEX_SLICE_US. Reads then return totals
+// that only grow while an event's group is counting, together with the time
+// each group has counted so far, from which counts are scaled.
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <papi.h>
+
+#include "runtime_internal.h"
+
+typedef struct {
+    int event_sets[MAX_GROUPS];
+    int running;
+    // Rotation only.
+    int active;                       // group counting now
+    int pinned;                       // no rotation while set
+    uint64_t active_since;            // when it started, in ns
+    long long totals[MAX_EVENTS];     // counted up to active_since
+    uint64_t group_ns[MAX_GROUPS];    // time each group counted up to active_since
+} ThreadCounters;
+
+// Parses TRACE_PAPI_EVENTS, initializes PAPI for threaded use and splits the
+// events into groups.
+void counters_init(void);
+
+void counters_thread_start(ThreadCounters* tc);
+void counters_thread_stop(ThreadCounters* tc);
+
+void counters_read_rotating(ThreadCounters* tc, long long* values, uint64_t* running);
+
+// With rotation, switches to `group` and keeps counting it until
+// counters_unpin(); used to calibrate the probe cost of each group.
+void counters_pin_group(ThreadCounters* tc, int group);
+void counters_unpin(ThreadCounters* tc);
+
+// PAPI_read on a running perf_event set is a user-space rdpmc when the
+// kernel allows it, so this is the only counter cost left on the hot path.
+// `running` receives the time each group has counted, with rotation only.
+static inline void counters_read(ThreadCounters* tc, long long* values, uint64_t* running) {
+    if (!tc->running) {
+        for (int i = 0; i < num_events; ++i) values[i] = 0;
+        for (int g = 0; g < num_groups; ++g) running[g] = 0;
+    } else if (multiplex_mode == MULTIPLEX_ROTATE) {
+        counters_read_rotating(tc, values, running);
+    } else {
+        PAPI_read(tc->event_sets[0], values);
+    }
+}
+
+#endif // COUNTERS_H
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include "functions.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const RuntimeFunctionInfo unregistered_info = {
+    "<unregistered>", "", "", 0, "", RUNTIME_KIND_FUNCTION,
+};
+
+// Entries live in fixed-size chunks so that growing the registry never moves
+// an entry another thread (e.g. the trace writer) may be reading. The first
+// chunk is static, so that looking up FUNCTION_UNREGISTERED needs nothing
+// to have been registered.
+static FunctionEntry first_chunk[FUNCTION_CHUNK_SIZE] = {
+    [FUNCTION_UNREGISTERED] = { .info = &unregistered_info },
+};
+FunctionEntry* function_chunks[FUNCTION_MAX_CHUNKS] = { first_chunk };
+static atomic_uint registered = FUNCTION_UNREGISTERED + 1;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Open-addressing index from (mangled name, file, line) to ID, only touched
+// under register_lock.
+static uint32_t* index_slots = NULL;  // ID + 1, 0 marks an empty slot
+static uint32_t index_capacity = 0;
+
+static uint64_t hash_str(uint64_t h, const char* s) {
+    for (; s && *s; ++s) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t hash_info(const RuntimeFunctionInfo* info) {
+    uint64_t h = 14695981039346656037ull;
+    h = hash_str(h, info->mangled_name);
+    h = hash_str(h, info->file);
+    h ^= info->line;
+    h *= 1099511628211ull;
+    return h;
+}
+
+static int same_function(const RuntimeFunctionInfo* a, const RuntimeFunctionInfo* b) {
+    return a->line == b->line &&
+           strcmp(a->mangled_name, b->mangled_name) == 0 &&
+           strcmp(a->file, b->file) == 0;
+}
+
+static void index_insert(uint32_t id) {
+    uint32_t mask = index_capacity - 1;
+    uint32_t slot = (uint32_t)hash_info(functions_get(id)) & mask;
+    while (index_slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    index_slots[slot] = id + 1;
+}
+
+static void index_grow(void) {
+    uint32_t* old = index_slots;
+    uint32_t old_capacity = index_capacity;
+
+    index_capacity = index_capacity ? index_capacity * 2 : 1024;
+    index_slots = calloc(index_capacity, sizeof(uint32_t));
+    if (!index_slots) {
+        fprintf(stderr, "Failed to grow function index\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (old[i] != 0) index_insert(old[i] - 1);
+    }
+    free(old);
+}
+
+static uint32_t register_one(const RuntimeFunctionInfo* info) {
+    uint32_t count = atomic_load_explicit(&registered, memory_order_relaxed);
+    if ((uint64_t)(count + 1) * 2 > index_capacity) {
+        index_grow();
+    }
+
+    uint32_t mask = index_capacity - 1;
+    uint32_t slot = (uint32_t)hash_info(info) & mask;
+    while (index_slots[slot] != 0) {
+        uint32_t id = index_slots[slot] - 1;
+        if (same_function(functions_get(id), info)) return id;
+        slot = (slot + 1) & mask;
+    }
+
+    if (count == FUNCTION_MAX_CHUNKS * FUNCTION_CHUNK_SIZE) {
+        fprintf(stderr, "Too many instrumented functions\n");
+        exit(1);
+    }
+    FunctionEntry* chunk = function_chunks[count >> FUNCTION_CHUNK_BITS];
+    if (!chunk) {
+        chunk = calloc(FUNCTION_CHUNK_SIZE, sizeof(FunctionEntry));
+        if (!chunk) {
+            fprintf(stderr, "Failed to allocate function registry\n");
+            exit(1);
+        }
+        function_chunks[count >> FUNCTION_CHUNK_BITS] = chunk;
+    }
+    FunctionEntry* e = &chunk[count & (FUNCTION_CHUNK_SIZE - 1)];
+    e->info = info;
+    atomic_init(&e->enabled, 1);
+    index_slots[slot] = count + 1;
+    atomic_store_explicit(&registered, count + 1, memory_order_release);
+    return count;
+}
+
+void runtime_register_functions(const RuntimeFunctionInfo* table, uint32_t count, uint32_t* ids) {
+    pthread_mutex_lock(&register_lock);
+    for (uint32_t i = 0; i < count; ++i) {
+        ids[i] = register_one(&table[i]);
+    }
+    pthread_mutex_unlock(&register_lock);
+}
+
+uint32_t functions_count(void) {
+    return atomic_load_explicit(&registered, memory_order_acquire);
+}
+
+const RuntimeFunctionInfo* functions_get(uint32_t id) {
+    return functions_entry(id)->info;
+}
+
+void functions_disable(uint32_t id) {
+    atomic_store_explicit(&functions_entry(id)->enabled, 0, memory_order_relaxed);
+}
+
+void functions_add_calls(uint32_t id, uint64_t calls, uint64_t recorded) {
+    FunctionEntry* e = functions_entry(id);
+    atomic_fetch_add_explicit(&e->calls, calls, memory_order_relaxed);
+    atomic_fetch_add_explicit(&e->recorded, recorded, memory_order_relaxed);
+}
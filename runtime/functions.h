@@ -0,0 +1,50 @@
+// runtime/functions.h
+//
+// Process-wide registry of instrumented functions, indexed by the IDs handed
+// out by runtime_register_functions(). Entries are never moved or removed,
+// so lookups need no lock.
+
+#ifndef FUNCTIONS_H
+#define FUNCTIONS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "runtime.h"
+
+#define FUNCTION_CHUNK_BITS 10
+#define FUNCTION_CHUNK_SIZE (1u << FUNCTION_CHUNK_BITS)
+#define FUNCTION_MAX_CHUNKS 1024  // up to 1M distinct functions
+
+// Reserved for probes that run before their table is registered. Its entry
+// exists from the start, named "<unregistered>", and is never enabled.
+#define FUNCTION_UNREGISTERED 0
+
+typedef struct {
+    const RuntimeFunctionInfo* info;
+    // Cleared by the throttling policy; checked by every entry probe.
+    atomic_uchar enabled;
+    // Calls made and calls recorded, folded in from threads as they exit.
+    _Atomic uint64_t calls;
+    _Atomic uint64_t recorded;
+} FunctionEntry;
+
+extern FunctionEntry* function_chunks[FUNCTION_MAX_CHUNKS];
+
+static inline FunctionEntry* functions_entry(uint32_t id) {
+    return &function_chunks[id >> FUNCTION_CHUNK_BITS][id & (FUNCTION_CHUNK_SIZE - 1)];
+}
+
+static inline int functions_enabled(uint32_t id) {
+    return atomic_load_explicit(&functions_entry(id)->enabled, memory_order_relaxed);
+}
+
+uint32_t functions_count(void);
+const RuntimeFunctionInfo* functions_get(uint32_t id);
+
+// Stops recording `id` on every thread from their next entry on.
+void functions_disable(uint32_t id);
+
+void functions_add_calls(uint32_t id, uint64_t calls, uint64_t recorded);
+
+#endif // FUNCTIONS_H
@@ -0,0 +1,347 @@
+#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
+
+#include "live.h"
+#include "functions.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LIVE_CAPACITY 4096
+#define DEFAULT_LIVE_INTERVAL_MS 500
+#define LIVE_POLL_MS 10
+
+int live_enabled = 0;
+
+static uint32_t capacity = DEFAULT_LIVE_CAPACITY;
+static uint64_t interval_ms = DEFAULT_LIVE_INTERVAL_MS;
+static const char* snapshot_prefix = "function_metrics_snapshot";
+static char segment_name[64];
+static LiveHeader* segment = NULL;
+static size_t segment_size = 0;
+
+// Sums built by the publisher before they are copied into the segment, so
+// the segment is only marked as changing for the length of one memcpy.
+static LiveFunction* scratch = NULL;
+static uint32_t named = 0;  // entries of `scratch` whose name is filled in
+
+// Live threads, and the totals of those that have exited. The publisher
+// holds the lock while summing, so threads only wait on it when they exit.
+static LiveThread* threads = NULL;
+static LiveThread retired;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t publisher_thread;
+static atomic_int publisher_stop = 0;
+static atomic_int snapshot_requested = 0;
+static unsigned snapshots_written = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+LiveSlot* live_chunk(LiveThread* lt, uint32_t id) {
+    LiveSlot* chunk = calloc(LIVE_CHUNK_SIZE, sizeof(LiveSlot));
+    if (!chunk) {
+        fprintf(stderr, "Failed to allocate live function stats\n");
+        exit(1);
+    }
+    atomic_store_explicit(&lt->chunks[id >> LIVE_CHUNK_BITS], chunk, memory_order_release);
+    return chunk;
+}
+
+static void add_stats(LiveStats* into, const LiveStats* from) {
+    into->calls += from->calls;
+    into->measured += from->measured;
+    into->ns += from->ns;
+    into->self_ns += from->self_ns;
+    for (int i = 0; i < num_events; ++i) {
+        into->counts[i] += from->counts[i];
+        into->self_counts[i] += from->self_counts[i];
+    }
+    for (int b = 0; b < LIVE_HIST_BUCKETS; ++b) {
+        into->hist[b] += from->hist[b];
+    }
+    for (int g = 0; g < num_groups; ++g) {
+        into->running_ns[g] += from->running_ns[g];
+    }
+}
+
+// Copies a slot that its owner may be updating concurrently.
+static void read_slot(LiveSlot* s, LiveStats* out) {
+    for (;;) {
+        uint32_t before = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (before & 1) continue;
+        memcpy(out, &s->stats, sizeof(LiveStats));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) == before) break;
+    }
+    out->calls = atomic_load_explicit(&s->calls, memory_order_relaxed);
+}
+
+static void sum_thread(LiveThread* lt, uint32_t n) {
+    for (uint32_t c = 0; c * LIVE_CHUNK_SIZE < n; ++c) {
+        LiveSlot* chunk = atomic_load_explicit(&lt->chunks[c], memory_order_acquire);
+        if (!chunk) continue;
+        for (uint32_t j = 0; j < LIVE_CHUNK_SIZE && c * LIVE_CHUNK_SIZE + j < n; ++j) {
+            LiveStats stats;
+            read_slot(&chunk[j], &stats);
+            add_stats(&scratch[c * LIVE_CHUNK_SIZE + j].stats, &stats);
+        }
+    }
+}
+
+static void fill_names(uint32_t n) {
+    for (; named < n; ++named) {
+        const RuntimeFunctionInfo* info = functions_get(named);
+        LiveFunction* f = &scratch[named];
+        f->kind = info->kind;
+        f->line = info->line;
+        if (info->kind == RUNTIME_KIND_FUNCTION && info->scope[0]) {
+            snprintf(f->name, sizeof(f->name), "%s::%s", info->scope, info->name);
+        } else {
+            snprintf(f->name, sizeof(f->name), "%s", info->name);
+        }
+        snprintf(f->file, sizeof(f->file), "%s", info->file);
+    }
+}
+
+static void write_snapshot(uint32_t n) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.%d.%u.csv", snapshot_prefix, (int)getpid(), snapshots_written++);
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open snapshot file %s\n", path);
+        return;
+    }
+
+    fprintf(out, "function_id,name,file,line,calls,measured,total_ns,self_ns,p50_ns,p90_ns,p99_ns");
+    for (int i = 0; i < num_events; ++i) {
+        fprintf(out, ",%s,%s_self", event_names[i], event_names[i]);
+    }
+    fprintf(out, "\n");
+    for (uint32_t id = 0; id < n; ++id) {
+        const LiveFunction* f = &scratch[id];
+        const LiveStats* s = &f->stats;
+        if (s->calls == 0) continue;
+        fprintf(out, "%u,\"%s\",\"%s\",%u,%llu,%llu,%llu,%llu,%.0f,%.0f,%.0f", id, f->name, f->file, f->line,
+                (unsigned long long)s->calls, (unsigned long long)s->measured, (unsigned long long)s->ns,
+                (unsigned long long)s->self_ns, live_percentile(s->hist, 0.5), live_percentile(s->hist, 0.9),
+                live_percentile(s->hist, 0.99));
+        for (int i = 0; i < num_events; ++i) {
+            fprintf(out, ",%lld,%lld", event_estimate(i, s->counts[i], s->ns, s->running_ns),
+                    event_estimate(i, s->self_counts[i], s->ns, s->running_ns));
+        }
+        fprintf(out, "\n");
+    }
+    fclose(out);
+    fprintf(stderr, "cd-lab: snapshot written to %s\n", path);
+}
+
+// Sums every thread into `scratch` and copies the result into the segment.
+// Only the publisher thread (or shutdown, once it has stopped) calls this.
+static uint32_t publish(void) {
+    uint32_t registered = functions_count();
+    uint32_t n = registered < capacity ? registered : capacity;
+
+    for (uint32_t id = 0; id < n; ++id) {
+        memset(&scratch[id].stats, 0, sizeof(LiveStats));
+    }
+    fill_names(n);
+    pthread_mutex_lock(&threads_lock);
+    sum_thread(&retired, n);
+    for (LiveThread* lt = threads; lt; lt = lt->next) {
+        sum_thread(lt, n);
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    uint64_t seq = __atomic_load_n(&segment->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(live_functions(segment), scratch, n * sizeof(LiveFunction));
+    segment->num_functions = n;
+    segment->registered = registered;
+    segment->update_ns = now_ns();
+    __atomic_store_n(&segment->seq, seq + 2, __ATOMIC_RELEASE);
+    return n;
+}
+
+static void* publisher_main(void* arg) {
+    (void)arg;
+    struct timespec poll = { .tv_sec = 0, .tv_nsec = LIVE_POLL_MS * 1000000L };
+    uint64_t next = 0;
+
+    while (!atomic_load(&publisher_stop)) {
+        int snapshot = atomic_exchange(&snapshot_requested, 0);
+        if (snapshot || now_ns() >= next) {
+            uint32_t n = publish();
+            if (snapshot) write_snapshot(n);
+            next = now_ns() + interval_ms * 1000000ull;
+        }
+        nanosleep(&poll, NULL);
+    }
+    return NULL;
+}
+
+static void on_snapshot_signal(int sig) {
+    (void)sig;
+    atomic_store(&snapshot_requested, 1);
+}
+
+// Takes SIGUSR1 unless the program already handles it.
+static void install_signal_handler(void) {
+    struct sigaction old;
+    if (sigaction(SIGUSR1, NULL, &old) != 0 || old.sa_handler != SIG_DFL) {
+        fprintf(stderr, "cd-lab: SIGUSR1 is in use; snapshots on signal are disabled\n");
+        return;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_snapshot_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+static int create_segment(void) {
+    snprintf(segment_name, sizeof(segment_name), LIVE_SEGMENT_PREFIX "%d", (int)getpid());
+    segment_size = sizeof(LiveHeader) + (size_t)capacity * sizeof(LiveFunction);
+
+    int fd = shm_open(segment_name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (fd < 0) return 0;
+    if (ftruncate(fd, (off_t)segment_size) != 0) {
+        close(fd);
+        shm_unlink(segment_name);
+        return 0;
+    }
+    void* p = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(segment_name);
+        return 0;
+    }
+    segment = p;
+
+    memcpy(segment->magic, LIVE_MAGIC, sizeof(segment->magic));
+    segment->version = LIVE_FORMAT_VERSION;
+    segment->max_events = MAX_EVENTS;
+    segment->hist_buckets = LIVE_HIST_BUCKETS;
+    segment->function_size = sizeof(LiveFunction);
+    segment->capacity = capacity;
+    segment->pid = (int32_t)getpid();
+    segment->start_ns = now_ns();
+    segment->update_ns = segment->start_ns;
+    segment->num_events = (uint32_t)num_events;
+    segment->multiplex_mode = (uint32_t)multiplex_mode;
+    segment->num_groups = (uint32_t)num_groups;
+    for (int i = 0; i < num_events; ++i) {
+        segment->event_group[i] = (uint32_t)event_group[i];
+        snprintf(segment->event_names[i], MAX_NAME_LEN, "%s", event_names[i]);
+    }
+    return 1;
+}
+
+void live_init(void) {
+    const char* env = getenv("TRACE_LIVE");
+    if (!env || atoi(env) <= 0) return;
+
+    env = getenv("TRACE_LIVE_CAPACITY");
+    if (env && atol(env) > 0) {
+        capacity = (uint32_t)atol(env);
+    }
+    env = getenv("TRACE_LIVE_INTERVAL_MS");
+    if (env && atol(env) > 0) {
+        interval_ms = (uint64_t)atol(env);
+    }
+    env = getenv("TRACE_SNAPSHOT_PREFIX");
+    if (env && strlen(env) > 0) {
+        snapshot_prefix = env;
+    }
+
+    scratch = calloc(capacity, sizeof(LiveFunction));
+    if (!scratch || !create_segment()) {
+        // Tracing goes on without the live view.
+        fprintf(stderr, "cd-lab: failed to create live segment %s\n", segment_name);
+        free(scratch);
+        scratch = NULL;
+        return;
+    }
+
+    if (pthread_create(&publisher_thread, NULL, publisher_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start live publisher thread\n");
+        exit(1);
+    }
+    install_signal_handler();
+    live_enabled = 1;
+    fprintf(stderr, "cd-lab: live metrics in %s\n", segment_name);
+}
+
+LiveThread* live_thread_acquire(void) {
+    if (!live_enabled) return NULL;
+
+    LiveThread* lt = calloc(1, sizeof(LiveThread));
+    if (!lt) {
+        fprintf(stderr, "Failed to allocate live thread stats\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&threads_lock);
+    lt->next = threads;
+    if (threads) threads->prev = lt;
+    threads = lt;
+    pthread_mutex_unlock(&threads_lock);
+    return lt;
+}
+
+void live_thread_release(LiveThread* lt) {
+    if (!lt) return;
+
+    pthread_mutex_lock(&threads_lock);
+    for (uint32_t c = 0; c < LIVE_MAX_CHUNKS; ++c) {
+        LiveSlot* chunk = atomic_load_explicit(&lt->chunks[c], memory_order_relaxed);
+        if (!chunk) continue;
+        LiveSlot* into = atomic_load_explicit(&retired.chunks[c], memory_order_relaxed);
+        if (!into) into = live_chunk(&retired, c << LIVE_CHUNK_BITS);
+        for (uint32_t j = 0; j < LIVE_CHUNK_SIZE; ++j) {
+            add_stats(&into[j].stats, &chunk[j].stats);
+            atomic_store_explicit(&into[j].calls,
+                                  atomic_load_explicit(&into[j].calls, memory_order_relaxed) +
+                                      atomic_load_explicit(&chunk[j].calls, memory_order_relaxed),
+                                  memory_order_relaxed);
+        }
+        free(chunk);
+    }
+    if (lt->prev) lt->prev->next = lt->next;
+    else threads = lt->next;
+    if (lt->next) lt->next->prev = lt->prev;
+    pthread_mutex_unlock(&threads_lock);
+    free(lt);
+}
+
+void live_shutdown(void) {
+    if (!live_enabled) return;
+
+    atomic_store(&publisher_stop, 1);
+    pthread_join(publisher_thread, NULL);
+    publish();
+    segment->exited = 1;
+
+    // A reader that is attached keeps its mapping; new ones find nothing.
+    munmap(segment, segment_size);
+    shm_unlink(segment_name);
+    live_enabled = 0;
+}
+
+void live_fork_child(void) {
+    if (!live_enabled) return;
+    munmap(segment, segment_size);
+    segment = NULL;
+    live_enabled = 0;
+}
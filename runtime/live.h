@@ -0,0 +1,88 @@
+// runtime/live.h
+//
+// Live per-function totals. Each thread keeps its own counts, one seqlock per
+// function, so updating them never blocks and never contends. A publisher
+// thread sums all threads into the shared-memory segment described in
+// live_format.h every TRACE_LIVE_INTERVAL_MS, and writes a snapshot file
+// when the process gets SIGUSR1.
+
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "live_format.h"
+#include "trace_buffer.h"
+
+#define LIVE_CHUNK_BITS 8
+#define LIVE_CHUNK_SIZE (1u << LIVE_CHUNK_BITS)
+#define LIVE_MAX_CHUNKS 4096  // as many functions as the registry holds
+
+typedef struct {
+    _Atomic uint32_t seq;    // odd while `stats` is being updated
+    _Atomic uint64_t calls;  // single writer, outside the seqlock
+    LiveStats stats;
+} LiveSlot;
+
+typedef struct LiveThread {
+    // Allocated by the owner on first use and never moved.
+    _Atomic(LiveSlot*) chunks[LIVE_MAX_CHUNKS];
+    struct LiveThread* next;
+    struct LiveThread* prev;
+} LiveThread;
+
+// Set from TRACE_LIVE by live_init().
+extern int live_enabled;
+
+// Creates the segment and starts the publisher. Call after counters_init().
+void live_init(void);
+
+LiveThread* live_thread_acquire(void);
+// Folds the thread's totals into those of exited threads and frees it.
+void live_thread_release(LiveThread* lt);
+
+// Publishes a last time, then removes the segment.
+void live_shutdown(void);
+
+// In a forked child, which has no publisher thread: unmaps the parent's
+// segment without publishing into it or removing it.
+void live_fork_child(void);
+
+LiveSlot* live_chunk(LiveThread* lt, uint32_t id);
+
+static inline LiveSlot* live_slot(LiveThread* lt, uint32_t id) {
+    LiveSlot* chunk = atomic_load_explicit(&lt->chunks[id >> LIVE_CHUNK_BITS], memory_order_relaxed);
+    if (!chunk) chunk = live_chunk(lt, id);
+    return &chunk[id & (LIVE_CHUNK_SIZE - 1)];
+}
+
+static inline void live_call(LiveThread* lt, uint32_t id) {
+    LiveSlot* s = live_slot(lt, id);
+    atomic_store_explicit(&s->calls, atomic_load_explicit(&s->calls, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+static inline void live_record(LiveThread* lt, uint32_t id, const TraceRecord* r) {
+    LiveSlot* s = live_slot(lt, id);
+    uint32_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    uint64_t ns = r->ns;
+    s->stats.measured++;
+    s->stats.ns += ns;
+    s->stats.self_ns += r->self_ns;
+    for (int i = 0; i < num_events; ++i) {
+        s->stats.counts[i] += r->counters[i];
+        s->stats.self_counts[i] += r->self_counters[i];
+    }
+    s->stats.hist[live_bucket(ns)]++;
+    if (multiplex_mode == MULTIPLEX_ROTATE) {
+        for (int g = 0; g < num_groups; ++g) s->stats.running_ns[g] += r->running_ns[g];
+    }
+
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+#endif // LIVE_H
@@ -0,0 +1,100 @@
+// runtime/live_format.h
+//
+// Layout of the shared-memory segment (/cdlab.<pid>) through which a running
+// program publishes its per-function totals, shared by the runtime and
+// cd_lab_top. The segment is a LiveHeader followed by `capacity` LiveFunction
+// slots, of which the first `num_functions` are in use, indexed by function
+// ID.
+//
+// The runtime rewrites the segment periodically. `seq` is odd while it does;
+// a reader copies what it needs and retries if `seq` was odd or changed in
+// the meantime. Totals only ever grow, so rates come from the difference of
+// two copies and their `update_ns`.
+
+#ifndef LIVE_FORMAT_H
+#define LIVE_FORMAT_H
+
+#include <stdint.h>
+
+#include "runtime_internal.h"
+
+#define LIVE_MAGIC "CDLABLV"
+#define LIVE_FORMAT_VERSION 1
+#define LIVE_SEGMENT_PREFIX "/cdlab."
+#define LIVE_NAME_LEN 128
+
+// Bucket 0 counts calls that took 0 ns, bucket b > 0 those that took
+// [2^(b-1), 2^b) ns; the last bucket also takes everything longer.
+#define LIVE_HIST_BUCKETS 40
+
+typedef struct {
+    uint64_t calls;     // entries, measured or not
+    uint64_t measured;
+    uint64_t ns;        // inclusive, probe overhead removed
+    uint64_t self_ns;
+    long long counts[MAX_EVENTS];
+    long long self_counts[MAX_EVENTS];
+    uint64_t hist[LIVE_HIST_BUCKETS];  // measured calls by inclusive time
+    uint64_t running_ns[MAX_GROUPS];   // with rotation, time each group counted
+} LiveStats;
+
+typedef struct {
+    uint32_t kind;  // RUNTIME_KIND_*
+    uint32_t line;
+    char name[LIVE_NAME_LEN];  // scope::name for functions, truncated
+    char file[LIVE_NAME_LEN];
+    LiveStats stats;
+} LiveFunction;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_events;     // MAX_EVENTS and LIVE_HIST_BUCKETS of the
+    uint32_t hist_buckets;   // runtime, so readers built against another
+    uint32_t function_size;  // layout can refuse the segment
+    uint32_t capacity;
+    int32_t pid;
+    uint64_t seq;            // accessed atomically
+    uint64_t start_ns;       // CLOCK_MONOTONIC
+    uint64_t update_ns;
+    uint32_t num_events;
+    uint32_t num_functions;
+    uint32_t registered;     // can exceed capacity; the rest are not shown
+    uint32_t exited;         // set by a clean shutdown
+    uint32_t multiplex_mode; // MULTIPLEX_*; with rotation, event counts are
+    uint32_t num_groups;     // scaled by ns over their group's running_ns
+    uint32_t event_group[MAX_EVENTS];
+    char event_names[MAX_EVENTS][MAX_NAME_LEN];
+} LiveHeader;
+
+static inline LiveFunction* live_functions(LiveHeader* h) {
+    return (LiveFunction*)(h + 1);
+}
+
+static inline uint32_t live_bucket(uint64_t ns) {
+    uint32_t b = ns ? 64 - (uint32_t)__builtin_clzll(ns) : 0;
+    return b < LIVE_HIST_BUCKETS ? b : LIVE_HIST_BUCKETS - 1;
+}
+
+// Estimates the q-quantile (0 < q <= 1) of a histogram by interpolating
+// linearly inside the bucket it falls in.
+static inline double live_percentile(const uint64_t* hist, double q) {
+    uint64_t total = 0;
+    for (int b = 0; b < LIVE_HIST_BUCKETS; ++b) total += hist[b];
+    if (total == 0) return 0;
+
+    double rank = q * (double)total;
+    uint64_t seen = 0;
+    for (int b = 0; b < LIVE_HIST_BUCKETS; ++b) {
+        if (hist[b] == 0) continue;
+        if ((double)(seen + hist[b]) >= rank) {
+            if (b == 0) return 0;
+            double low = (double)(1ull << (b - 1));
+            return low + low * (rank - (double)seen) / (double)hist[b];
+        }
+        seen += hist[b];
+    }
+    return (double)(1ull << (LIVE_HIST_BUCKETS - 1));
+}
+
+#endif // LIVE_FORMAT_H
@@ -1,162 +1,599 @@
-
 #define _POSIX_C_SOURCE 199309L
 #define _GNU_SOURCE
 
 #include "runtime.h"
+#include "cct.h"
+#include "counters.h"
+#include "functions.h"
+#include "live.h"
+#include "trace_buffer.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <papi.h>
 
-#define MAX_FUNCS 1024
-#define MAX_EVENTS 4
-#define MAX_NAME_LEN 128
+#define MAX_DEPTH 512
+#define CALIBRATION_ID UINT32_MAX
+#define CALIBRATION_BATCHES 20
+#define CALIBRATION_BATCH_SIZE 500
+
+// One activation on the shadow call stack. Children add their inclusive
+// cost to child_ns/child_counts so the frame can report its own self cost.
+// Frames that are not measured (throttled or sampled out) pass whatever
+// their children reported on to their own parent, as if inlined. Loop and
+// region frames (transparent) are measured but do the same, so that
+// instrumenting them leaves the enclosing function's self cost unchanged.
+typedef struct {
+    uint32_t func_id;
+    int skip;
+    int transparent;
+    uint64_t trips;  // loop iterations, set when a region closes
+    CctNode* node;   // calling context, when TRACE_CCT is set
+    // Probe pairs underneath, used to take calibrated probe cost back out.
+    uint32_t children;            // measured, nearest measured ancestor is this frame
+    uint32_t skipped_children;    // unmeasured, nearest measured ancestor is this frame
+    uint32_t regions;             // transparent, nearest measured ancestor is this frame
+    uint64_t descendants;         // measured, anywhere below
+    uint64_t skipped_descendants; // unmeasured, anywhere below
+    uint64_t start_ns;
+    uint64_t child_ns;
+    long long start_counts[MAX_EVENTS];
+    long long child_counts[MAX_EVENTS];
+    uint64_t start_running[MAX_GROUPS];  // with rotation, see counters.h
+} Frame;
+
+// Uncorrected inclusive cost of one measured call.
+typedef struct {
+    uint32_t func_id;
+    uint64_t ns;
+    long long counts[MAX_EVENTS];
+} RawCost;
+
+// Per-thread running counts for one function, folded into the registry when
+// the thread exits.
+typedef struct {
+    uint64_t calls;
+    uint64_t recorded;
+    uint64_t raw_ns;
+} ThreadFuncStats;
+
+// Everything a thread needs on the probe path, created on its first entry.
+typedef struct ThreadState {
+    ThreadBuffer* buffer;
+    ThreadCounters counters;
+    int depth;
+    int overflow;  // calls deeper than MAX_DEPTH, entered but not tracked
+    ThreadFuncStats* stats;
+    uint32_t stats_cap;
+    struct ThreadState* next_live;
+    struct ThreadState* prev_live;
+    CctTree cct;
+    LiveThread* live;  // NULL unless TRACE_LIVE is set
+    Frame stack[MAX_DEPTH];
+} ThreadState;
 
+// Calibrated probe cost, in ns and in each event.
 typedef struct {
-    char func_name[MAX_NAME_LEN];
-    double start_time;
-    double end_time;
-    long long papi_start[MAX_EVENTS];
-    long long papi_end[MAX_EVENTS];
-} FunctionCall;
-
-static FunctionCall logs[MAX_FUNCS];
-static int log_index = 0;
-static int event_set = PAPI_NULL;
-static int num_events = 0;
-static int event_codes[MAX_EVENTS];
-static char* event_names[MAX_EVENTS];  // char* instead of const char* for strdup
-
-static __thread long long thread_start_values[MAX_EVENTS];
-static __thread struct timespec thread_start_time;
-static __thread const char* thread_func_name = NULL;
+    double ns;
+    double counts[MAX_EVENTS];
+} ProbeCost;
 
+static ProbeCost cost_self;     // share of a measured pair inside its own interval
+static ProbeCost cost_pair;     // a measured pair as seen from its caller
+static ProbeCost cost_skipped;  // an unmeasured pair as seen from its caller
+static int calibrate = 1;
+
+static uint64_t sample_rate = 1;
+static uint64_t throttle_calls = 0;
+static double throttle_budget = 0;
+static uint64_t throttle_min_calls = 1000;
+
+static __thread ThreadState* thread_state = NULL;
+static ThreadState* live_threads = NULL;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
 static int initialized = 0;
+static int forked_child = 0;  // see fork_child()
 
-static double get_time_in_seconds(const struct timespec* ts) {
-    return ts->tv_sec + ts->tv_nsec / 1e9;
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
-void init_papi() {
-    if (initialized) return;
+static uint64_t env_u64(const char* name, uint64_t fallback) {
+    const char* env = getenv(name);
+    return env && strlen(env) > 0 ? strtoull(env, NULL, 10) : fallback;
+}
 
-    if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-        fprintf(stderr, "PAPI init failed!\n");
-        exit(1);
+static void fold_stats(ThreadState* ts) {
+    for (uint32_t id = 0; id < ts->stats_cap; ++id) {
+        ThreadFuncStats* st = &ts->stats[id];
+        if (st->calls > 0 || st->recorded > 0) {
+            functions_add_calls(id, st->calls, st->recorded);
+        }
     }
+    memset(ts->stats, 0, ts->stats_cap * sizeof(ThreadFuncStats));
+}
+
+// Runs when an instrumented thread exits. The main thread never gets here;
+// its event set is torn down by PAPI_shutdown().
+static void release_thread(void* arg) {
+    ThreadState* ts = arg;
 
-    if (PAPI_create_eventset(&event_set) != PAPI_OK) {
-        fprintf(stderr, "Failed to create event set\n");
+    pthread_mutex_lock(&live_lock);
+    fold_stats(ts);
+    if (cct_enabled) cct_collect(&ts->cct, 1);
+    if (ts->prev_live) ts->prev_live->next_live = ts->next_live;
+    else live_threads = ts->next_live;
+    if (ts->next_live) ts->next_live->prev_live = ts->prev_live;
+    pthread_mutex_unlock(&live_lock);
+
+    live_thread_release(ts->live);
+    counters_thread_stop(&ts->counters);
+    trace_buffer_release(ts->buffer);
+    thread_state = NULL;
+    free(ts->stats);
+    free(ts);
+}
+
+static void init_runtime(void) {
+    counters_init();
+
+    if (pthread_key_create(&thread_key, release_thread) != 0) {
+        fprintf(stderr, "Failed to create thread key\n");
         exit(1);
     }
 
-    const char* env = getenv("TRACE_PAPI_EVENTS");
-    if (env && strlen(env) > 0) {
-        fprintf(stderr, "TRACE_PAPI_EVENTS = %s\n", env);
-        char* env_copy = strdup(env);
-        char* token = strtok(env_copy, ",");
-        while (token && num_events < MAX_EVENTS) {
-            token[strcspn(token, "\n")] = 0; // remove newline
-            event_names[num_events] = strdup(token);
-            if (PAPI_event_name_to_code(event_names[num_events], &event_codes[num_events]) != PAPI_OK) {
-                fprintf(stderr, "Invalid PAPI event name: %s\n", event_names[num_events]);
-                exit(1);
-            }
-            num_events++;
-            token = strtok(NULL, ",");
+    sample_rate = env_u64("TRACE_SAMPLE_RATE", 1);
+    if (sample_rate == 0) sample_rate = 1;
+    throttle_calls = env_u64("TRACE_THROTTLE_CALLS", 0);
+    throttle_min_calls = env_u64("TRACE_THROTTLE_MIN_CALLS", 1000);
+    const char* budget = getenv("TRACE_THROTTLE_BUDGET");
+    if (budget && strlen(budget) > 0) {
+        throttle_budget = atof(budget);
+    }
+    calibrate = (int)env_u64("TRACE_CALIBRATE", 1);
+    cct_init();
+
+    trace_buffer_init();
+    live_init();
+    initialized = 1;
+}
+
+void init_papi() {
+    pthread_once(&init_once, init_runtime);
+}
+
+static ThreadFuncStats* get_stats(ThreadState* ts, uint32_t id) {
+    if (id >= ts->stats_cap) {
+        uint32_t cap = functions_count();
+        if (cap <= id) cap = id + 1;
+        ThreadFuncStats* grown = realloc(ts->stats, cap * sizeof(ThreadFuncStats));
+        if (!grown) {
+            fprintf(stderr, "Failed to grow per-thread function stats\n");
+            exit(1);
         }
-        free(env_copy);
-    } else {
-        // fallback defaults
-        event_names[0] = strdup("PAPI_TOT_INS");
-        event_names[1] = strdup("PAPI_L1_DCM");
-        num_events = 2;
-        for (int i = 0; i < num_events; i++) {
-            if (PAPI_event_name_to_code(event_names[i], &event_codes[i]) != PAPI_OK) {
-                fprintf(stderr, "Error mapping default event: %s\n", event_names[i]);
-                exit(1);
-            }
+        memset(grown + ts->stats_cap, 0, (cap - ts->stats_cap) * sizeof(ThreadFuncStats));
+        ts->stats = grown;
+        ts->stats_cap = cap;
+    }
+    return &ts->stats[id];
+}
+
+static inline long long corrected(long long raw, double overhead) {
+    long long v = raw - (long long)overhead;
+    return v > 0 ? v : 0;
+}
+
+static inline void probe_enter(ThreadState* ts, uint32_t func_id, int skip, int transparent) {
+    if (ts->depth == MAX_DEPTH) {
+        ts->overflow++;
+        return;
+    }
+
+    Frame* f = &ts->stack[ts->depth++];
+    f->func_id = func_id;
+    f->skip = skip;
+    f->transparent = transparent;
+    f->trips = 0;
+    f->node = NULL;
+    f->children = 0;
+    f->skipped_children = 0;
+    f->regions = 0;
+    f->descendants = 0;
+    f->skipped_descendants = 0;
+    f->child_ns = 0;
+    for (int i = 0; i < num_events; ++i) {
+        f->child_counts[i] = 0;
+    }
+    if (skip) return;
+
+    f->start_ns = now_ns();
+    counters_read(&ts->counters, f->start_counts, f->start_running);
+}
+
+// Hands everything `f` collected from below on to `parent`, as if the calls
+// underneath `f` had been made by `parent` directly.
+static inline void pass_through(Frame* parent, const Frame* f) {
+    parent->child_ns += f->child_ns;
+    for (int i = 0; i < num_events; ++i) {
+        parent->child_counts[i] += f->child_counts[i];
+    }
+    parent->children += f->children;
+    parent->skipped_children += f->skipped_children;
+    parent->regions += f->regions;
+    parent->descendants += f->descendants;
+    parent->skipped_descendants += f->skipped_descendants;
+}
+
+// Pops the top frame. Returns 0 if it was not measured. Otherwise fills
+// `raw` with its uncorrected inclusive cost and, if `r` is non-NULL, the
+// record with calibrated probe overhead removed.
+static inline int probe_exit(ThreadState* ts, TraceRecord* r, RawCost* raw) {
+    if (ts->overflow > 0) {
+        ts->overflow--;
+        return 0;
+    }
+    if (ts->depth == 0) return 0;
+
+    Frame* f = &ts->stack[ts->depth - 1];
+    long long end_counts[MAX_EVENTS];
+    uint64_t end_running[MAX_GROUPS];
+    uint64_t end_ns = 0;
+    if (!f->skip) {
+        counters_read(&ts->counters, end_counts, end_running);
+        end_ns = now_ns();
+    }
+
+    ts->depth--;
+    Frame* parent = ts->depth > 0 ? &ts->stack[ts->depth - 1] : NULL;
+
+    if (f->skip) {
+        if (parent) {
+            pass_through(parent, f);
+            parent->skipped_children++;
+            parent->skipped_descendants++;
         }
+        return 0;
     }
 
-    if (PAPI_add_events(event_set, event_codes, num_events) != PAPI_OK) {
-        fprintf(stderr, "Failed to add events to event set\n");
-        exit(1);
+    raw->func_id = f->func_id;
+    raw->ns = end_ns - f->start_ns;
+    for (int i = 0; i < num_events; ++i) {
+        raw->counts[i] = end_counts[i] - f->start_counts[i];
+    }
+    if (parent && f->transparent) {
+        pass_through(parent, f);
+        parent->regions++;
+        parent->descendants++;
+    } else if (parent) {
+        parent->child_ns += raw->ns;
+        for (int i = 0; i < num_events; ++i) {
+            parent->child_counts[i] += raw->counts[i];
+        }
+        parent->children++;
+        parent->descendants += f->descendants + 1;
+        parent->skipped_descendants += f->skipped_descendants;
     }
+    if (!r) return 1;
 
-    initialized = 1;
+    // Inclusive values carry the full cost of every probe pair underneath;
+    // self values only the part of each measured child's pair that falls
+    // outside the child's own interval (cost_pair - cost_self), and the
+    // whole pair of each region, whose interval is counted as self.
+    double incl_overhead = cost_self.ns + f->descendants * cost_pair.ns +
+                           f->skipped_descendants * cost_skipped.ns;
+    double self_overhead = cost_self.ns + f->children * (cost_pair.ns - cost_self.ns) +
+                           f->skipped_children * cost_skipped.ns + f->regions * cost_pair.ns;
+    r->func_id = f->func_id;
+    r->depth = (uint32_t)ts->depth;
+    // The interval stays as measured, so that calls still nest; the
+    // corrections only apply to the costs. Self never exceeds inclusive,
+    // which the separate corrections alone do not guarantee.
+    r->start_ns = f->start_ns;
+    r->end_ns = end_ns;
+    r->ns = (uint64_t)corrected((long long)raw->ns, incl_overhead);
+    r->self_ns = (uint64_t)corrected((long long)(raw->ns - f->child_ns), self_overhead);
+    if (r->self_ns > r->ns) r->self_ns = r->ns;
+    r->trips = f->trips;
+    if (multiplex_mode == MULTIPLEX_ROTATE) {
+        // Shrunk along with the call's time, so that running over enabled
+        // stays the share of the call the group counted.
+        double kept = raw->ns ? (double)r->ns / (double)raw->ns : 0;
+        for (int g = 0; g < num_groups; ++g) {
+            r->running_ns[g] = (uint64_t)((double)(end_running[g] - f->start_running[g]) * kept);
+        }
+    }
+    for (int i = 0; i < num_events; ++i) {
+        incl_overhead = cost_self.counts[i] + f->descendants * cost_pair.counts[i] +
+                        f->skipped_descendants * cost_skipped.counts[i];
+        self_overhead = cost_self.counts[i] + f->children * (cost_pair.counts[i] - cost_self.counts[i]) +
+                        f->skipped_children * cost_skipped.counts[i] + f->regions * cost_pair.counts[i];
+        if (multiplex_mode == MULTIPLEX_ROTATE) {
+            // Only the probes that ran while the event's group counted
+            // showed up in its count.
+            double share = r->ns ? (double)r->running_ns[event_group[i]] / (double)r->ns : 0;
+            if (share > 1) share = 1;
+            incl_overhead *= share;
+            self_overhead *= share;
+        }
+        r->counters[i] = corrected(raw->counts[i], incl_overhead);
+        r->self_counters[i] = corrected(raw->counts[i] - f->child_counts[i], self_overhead);
+        if (r->self_counters[i] > r->counters[i]) r->self_counters[i] = r->counters[i];
+    }
+    return 1;
 }
 
-void runtime_function_entry(const char* func_name) {
-    init_papi();
+// Mean raw inclusive cost of an empty call containing `nested` (0: nothing,
+// 1: one measured empty call, 2: one unmeasured empty call), taken from the
+// quietest of several batches since interrupts and migrations only add cost.
+static ProbeCost measure_probe(ThreadState* ts, int nested) {
+    ProbeCost best;
+    best.ns = 1e30;
+    for (int i = 0; i < num_events; ++i) best.counts[i] = 1e30;
 
-    thread_func_name = func_name;
-    clock_gettime(CLOCK_MONOTONIC, &thread_start_time);
+    for (int b = 0; b < CALIBRATION_BATCHES; ++b) {
+        ProbeCost sum = { 0 };
+        for (int k = 0; k < CALIBRATION_BATCH_SIZE; ++k) {
+            RawCost raw, inner;
+            probe_enter(ts, CALIBRATION_ID, 0, 0);
+            if (nested) {
+                probe_enter(ts, CALIBRATION_ID, nested == 2, 0);
+                probe_exit(ts, NULL, &inner);
+            }
+            probe_exit(ts, NULL, &raw);
+            sum.ns += raw.ns;
+            for (int i = 0; i < num_events; ++i) sum.counts[i] += raw.counts[i];
+        }
+        if (sum.ns / CALIBRATION_BATCH_SIZE < best.ns) best.ns = sum.ns / CALIBRATION_BATCH_SIZE;
+        for (int i = 0; i < num_events; ++i) {
+            double mean = sum.counts[i] / CALIBRATION_BATCH_SIZE;
+            if (mean < best.counts[i]) best.counts[i] = mean;
+        }
+    }
+    return best;
+}
 
-    if (PAPI_start(event_set) != PAPI_OK) {
-        fprintf(stderr, "PAPI_start failed\n");
+// A difference of two noisy minimums can come out below zero; a probe never
+// costs less than nothing.
+static double non_negative(double cost) {
+    return cost > 0 ? cost : 0;
+}
+
+static void calibrate_probes(void) {
+    ThreadState* ts = thread_state;
+    if (!calibrate || !ts) return;
+
+    // With rotation each group is measured while it is the one counting;
+    // the times come from the first pass.
+    int passes = multiplex_mode == MULTIPLEX_ROTATE ? num_groups : 1;
+    for (int g = 0; g < passes; ++g) {
+        counters_pin_group(&ts->counters, g);
+        ProbeCost base = measure_probe(ts, 0);
+        ProbeCost with_child = measure_probe(ts, 1);
+        ProbeCost with_skipped = measure_probe(ts, 2);
+
+        if (g == 0) {
+            cost_self.ns = non_negative(base.ns);
+            cost_pair.ns = non_negative(with_child.ns - base.ns);
+            cost_skipped.ns = non_negative(with_skipped.ns - base.ns);
+        }
+        for (int i = 0; i < num_events; ++i) {
+            if (passes > 1 && event_group[i] != g) continue;
+            cost_self.counts[i] = non_negative(base.counts[i]);
+            cost_pair.counts[i] = non_negative(with_child.counts[i] - base.counts[i]);
+            cost_skipped.counts[i] = non_negative(with_skipped.counts[i] - base.counts[i]);
+        }
     }
+    counters_unpin(&ts->counters);
 
-    if (PAPI_read(event_set, thread_start_values) != PAPI_OK) {
-        fprintf(stderr, "PAPI_read (entry) failed\n");
+    fprintf(stderr, "cd-lab: probe cost %.1f ns per call, %.1f ns per nested call, %.1f ns per unmeasured call",
+            cost_self.ns, cost_pair.ns, cost_skipped.ns);
+    for (int i = 0; i < num_events; ++i) {
+        fprintf(stderr, "; %s %.1f/%.1f/%.1f", event_names[i], cost_self.counts[i], cost_pair.counts[i],
+                cost_skipped.counts[i]);
     }
+    fprintf(stderr, "\n");
 }
 
-void runtime_function_exit(const char* func_name) {
-    if (!initialized) return;
+// Returns NULL in a forked child, whose threads are not traced.
+static ThreadState* init_thread(void) {
+    if (forked_child) return NULL;
+    init_papi();
 
-    long long end_values[MAX_EVENTS];
-    struct timespec end_time;
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    ThreadState* ts = calloc(1, sizeof(ThreadState));
+    if (!ts) {
+        fprintf(stderr, "Failed to allocate thread state\n");
+        exit(1);
+    }
+    ts->buffer = trace_buffer_acquire();
+    cct_tree_init(&ts->cct);
+    ts->live = live_thread_acquire();
+    counters_thread_start(&ts->counters);
 
-    if (PAPI_read(event_set, end_values) != PAPI_OK) {
-        fprintf(stderr, "PAPI_read (exit) failed\n");
+    pthread_mutex_lock(&live_lock);
+    ts->next_live = live_threads;
+    if (live_threads) live_threads->prev_live = ts;
+    live_threads = ts;
+    pthread_mutex_unlock(&live_lock);
+
+    pthread_setspecific(thread_key, ts);
+    thread_state = ts;
+
+    // The first thread measures the probe cost; others wait for it so that
+    // none of their records go out uncorrected.
+    pthread_once(&calibrate_once, calibrate_probes);
+    return ts;
+}
+
+static inline void enter_call(ThreadState* ts, uint32_t func_id, int transparent) {
+    // With sampling, calls 1, N+1, 2N+1, ... of each function are measured.
+    ThreadFuncStats* st = get_stats(ts, func_id);
+    int skip = !functions_enabled(func_id) || (sample_rate > 1 && st->calls % sample_rate != 0);
+    st->calls++;
+    if (ts->live) live_call(ts->live, func_id);
+
+    // The context is tracked for every call, measured or not, so that the
+    // paths below a sampled-out call stay complete.
+    CctNode* node = NULL;
+    if (cct_enabled && ts->depth < MAX_DEPTH && ts->overflow == 0) {
+        CctNode* parent = ts->depth > 0 ? ts->stack[ts->depth - 1].node : NULL;
+        if (!parent) parent = &ts->cct.root;
+        node = cct_child(&ts->cct, parent, func_id);
+        node->calls++;
     }
+    probe_enter(ts, func_id, skip, transparent);
+    if (node) ts->stack[ts->depth - 1].node = node;
+}
 
-    if (PAPI_stop(event_set, NULL) != PAPI_OK) {
-        fprintf(stderr, "PAPI_stop failed\n");
+static inline void exit_call(ThreadState* ts) {
+    TraceRecord* r = NULL;
+    TraceRecord spare;
+    CctNode* node = NULL;
+    if (ts->overflow == 0 && ts->depth > 0 && !ts->stack[ts->depth - 1].skip) {
+        r = trace_buffer_reserve(ts->buffer);
+        node = ts->stack[ts->depth - 1].node;
     }
+    // The tree and the live totals still want the call's cost when the ring
+    // is full.
+    TraceRecord* out = r ? r : (node || ts->live) ? &spare : NULL;
 
-    if (log_index < MAX_FUNCS) {
-        FunctionCall* f = &logs[log_index++];
-        snprintf(f->func_name, MAX_NAME_LEN, "%s", thread_func_name);
-        f->start_time = get_time_in_seconds(&thread_start_time);
-        f->end_time = get_time_in_seconds(&end_time);
-        for (int i = 0; i < num_events; ++i) {
-            f->papi_start[i] = thread_start_values[i];
-            f->papi_end[i] = end_values[i];
-        }
+    RawCost raw;
+    if (!probe_exit(ts, out, &raw)) return;
+    if (node) cct_add(node, out);
+    if (ts->live) live_record(ts->live, raw.func_id, out);
+    if (r) trace_buffer_commit(ts->buffer);
+
+    ThreadFuncStats* st = get_stats(ts, raw.func_id);
+    st->recorded++;
+    st->raw_ns += raw.ns;
+
+    // Stop measuring functions whose probes cost more than they measure.
+    if ((throttle_calls > 0 && st->recorded >= throttle_calls) ||
+        (throttle_budget > 0 && st->recorded >= throttle_min_calls &&
+         st->recorded * cost_pair.ns > throttle_budget * st->raw_ns)) {
+        functions_disable(raw.func_id);
     }
 }
 
-static void dump_logs() {
-    FILE* f = fopen("function_metrics.csv", "w");
-    if (!f) {
-        perror("fopen");
+void runtime_function_entry(uint32_t func_id) {
+    if (func_id == FUNCTION_UNREGISTERED) return;
+    ThreadState* ts = thread_state;
+    if (!ts && !(ts = init_thread())) return;
+    enter_call(ts, func_id, 0);
+}
+
+void runtime_function_exit(uint32_t func_id) {
+    ThreadState* ts = thread_state;
+    if (!ts || func_id == FUNCTION_UNREGISTERED) return;
+    // Calls past MAX_DEPTH keep no frame to check the ID against.
+    if (ts->overflow > 0) {
+        exit_call(ts);
         return;
     }
+    // Closes the innermost call of `func_id`, and with it any calls above it
+    // whose exits were missed. An exit without a matching call is ignored
+    // rather than closing some other function's call.
+    int depth = ts->depth;
+    while (depth > 0 && ts->stack[depth - 1].func_id != func_id) depth--;
+    if (depth == 0) return;
+    while (ts->depth >= depth) exit_call(ts);
+}
 
-    fprintf(f, "function_name,start_timestamp,end_timestamp");
-    for (int i = 0; i < num_events; ++i) {
-        fprintf(f, ",%s", event_names[i]);
+RuntimeScope runtime_scope_enter(uint32_t func_id) {
+    ThreadState* ts = thread_state;
+    // An empty scope: its exit finds nothing above it to close.
+    if (func_id == FUNCTION_UNREGISTERED) return ts ? (RuntimeScope)(ts->depth + ts->overflow) : 0;
+    if (!ts && !(ts = init_thread())) return 0;
+    RuntimeScope scope = (RuntimeScope)(ts->depth + ts->overflow);
+    enter_call(ts, func_id, 0);
+    return scope;
+}
+
+void runtime_scope_exit(RuntimeScope* scope) {
+    ThreadState* ts = thread_state;
+    if (!ts) return;
+    // Normally one frame. More are left when a longjmp skipped the exits of
+    // the calls it unwound; they are closed here, ending now.
+    while ((RuntimeScope)(ts->depth + ts->overflow) > *scope) {
+        exit_call(ts);
+    }
+}
+
+RuntimeRegion runtime_region_enter(uint32_t region_id) {
+    ThreadState* ts = thread_state;
+    if (region_id == FUNCTION_UNREGISTERED) {
+        return (RuntimeRegion){ ts ? (RuntimeScope)(ts->depth + ts->overflow) : 0, 0 };
     }
-    fprintf(f, "\n");
+    if (!ts && !(ts = init_thread())) return (RuntimeRegion){ 0, 0 };
+    RuntimeRegion region = { (RuntimeScope)(ts->depth + ts->overflow), 0 };
+    enter_call(ts, region_id, 1);
+    return region;
+}
 
-    for (int i = 0; i < log_index; ++i) {
-        FunctionCall* fc = &logs[i];
-        fprintf(f, "%s,%.9f,%.9f", fc->func_name, fc->start_time, fc->end_time);
-        for (int j = 0; j < num_events; ++j) {
-            fprintf(f, ",%lld", fc->papi_end[j] - fc->papi_start[j]);
-        }
-        fprintf(f, "\n");
+void runtime_region_exit(RuntimeRegion* region) {
+    ThreadState* ts = thread_state;
+    if (!ts) return;
+    if (region->scope < (RuntimeScope)ts->depth) {
+        ts->stack[region->scope].trips = region->trips;
     }
+    runtime_scope_exit(&region->scope);
+}
+
+// A child forked from a traced parent has only the thread that called
+// fork(): no trace writer, no live publisher, and event sets that belong to
+// the parent's thread. It is not traced. Its probes do nothing, and at exit
+// it neither joins threads it does not have nor writes to the parent's
+// trace. A child forked before the parent's first probe shares none of that
+// and is traced like any other process.
+static void fork_child(void) {
+    if (!initialized) return;
+    forked_child = 1;
+    thread_state = NULL;
+    pthread_setspecific(thread_key, NULL);
+    trace_buffer_fork_child();
+    live_fork_child();
+    initialized = 0;
+}
 
-    fclose(f);
+// Registered once at load time, before the program can fork.
+__attribute__((constructor))
+static void register_fork_handler(void) {
+    pthread_atfork(NULL, NULL, fork_child);
 }
 
 __attribute__((destructor))
 void shutdown_runtime() {
-    dump_logs();
+    if (!initialized) return;
+
+    // Only the exiting thread's own counts and tree are safe to read. Other
+    // threads still running may grow their stats array or add tree nodes
+    // meanwhile, so what they counted is left out; their records are still
+    // in the trace. Threads that have exited were folded in as they left.
+    int running = 0;
+    pthread_mutex_lock(&live_lock);
+    for (ThreadState* ts = live_threads; ts; ts = ts->next_live) {
+        if (ts != thread_state) {
+            running++;
+            continue;
+        }
+        fold_stats(ts);
+        if (cct_enabled) cct_collect(&ts->cct, 0);
+    }
+    pthread_mutex_unlock(&live_lock);
+
+    live_shutdown();
+    trace_buffer_shutdown();
+    if (running > 0) {
+        fprintf(stderr, "cd-lab: %d threads still running at exit; their call counts%s are not included\n", running,
+                cct_enabled ? " and calling contexts" : "");
+    }
+    cct_shutdown();
     PAPI_shutdown();
 }
@@ -3,15 +3,92 @@
 #ifndef RUNTIME_H
 #define RUNTIME_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void runtime_function_entry(const char* func_name);
-void runtime_function_exit(const char* func_name);
+#define RUNTIME_KIND_FUNCTION 0
+#define RUNTIME_KIND_LOOP 1
+#define RUNTIME_KIND_REGION 2
+
+// Static description of one instrumented function, loop or region. The
+// instrumentor emits a table of these into every translation unit it
+// rewrites.
+typedef struct {
+    const char* name;
+    const char* mangled_name;
+    const char* file;
+    unsigned line;
+    const char* scope;  // enclosing class/namespace, "" at file scope; for
+                        // loops and regions, the enclosing function
+    unsigned kind;      // RUNTIME_KIND_*
+} RuntimeFunctionInfo;
+
+// Called from a constructor in each instrumented translation unit. Assigns a
+// process-wide ID to each of the `count` entries of `table` and stores it in
+// the matching slot of `ids`. Entries describing the same function (same
+// mangled name, file and line) share one ID.
+//
+// ID 0 is never assigned: it is what a zero-initialized ID array holds
+// before its table is registered, and the probes ignore calls made with it.
+void runtime_register_functions(const RuntimeFunctionInfo* table, uint32_t count, uint32_t* ids);
+
+void runtime_function_entry(uint32_t func_id);
+void runtime_function_exit(uint32_t func_id);
+
+// Token for one instrumented call: the thread's call depth before it began.
+typedef uint32_t RuntimeScope;
+
+// Scope-based probes. runtime_scope_exit closes the call opened by the
+// matching runtime_scope_enter, along with any calls above it that were
+// skipped by longjmp.
+RuntimeScope runtime_scope_enter(uint32_t func_id);
+void runtime_scope_exit(RuntimeScope* scope);
+
+// A loop or region inside an instrumented function. It is recorded like a
+// call, with the iterations the code counted in `trips`, but its cost still
+// counts as the enclosing function's own.
+typedef struct {
+    RuntimeScope scope;
+    uint64_t trips;
+} RuntimeRegion;
+
+RuntimeRegion runtime_region_enter(uint32_t region_id);
+void runtime_region_exit(RuntimeRegion* region);
 
 #ifdef __cplusplus
 }
+
+// Closes the call when the enclosing function is left, whether it returns
+// normally or unwinds with an exception.
+class RuntimeScopeGuard {
+public:
+    explicit RuntimeScopeGuard(uint32_t func_id) : scope_(runtime_scope_enter(func_id)) {}
+    ~RuntimeScopeGuard() { runtime_scope_exit(&scope_); }
+    RuntimeScopeGuard(const RuntimeScopeGuard&) = delete;
+    RuntimeScopeGuard& operator=(const RuntimeScopeGuard&) = delete;
+
+private:
+    RuntimeScope scope_;
+};
+
+class RuntimeRegionGuard : public RuntimeRegion {
+public:
+    explicit RuntimeRegionGuard(uint32_t region_id) : RuntimeRegion(runtime_region_enter(region_id)) {}
+    ~RuntimeRegionGuard() { runtime_region_exit(this); }
+    RuntimeRegionGuard(const RuntimeRegionGuard&) = delete;
+    RuntimeRegionGuard& operator=(const RuntimeRegionGuard&) = delete;
+};
+
+#define RUNTIME_SCOPE(func_id) RuntimeScopeGuard __cdlab_scope(func_id)
+#define RUNTIME_REGION(region_id, var) RuntimeRegionGuard var(region_id)
+#else
+#define RUNTIME_SCOPE(func_id) \
+    RuntimeScope __cdlab_scope __attribute__((cleanup(runtime_scope_exit))) = runtime_scope_enter(func_id)
+#define RUNTIME_REGION(region_id, var) \
+    RuntimeRegion var __attribute__((cleanup(runtime_region_exit))) = runtime_region_enter(region_id)
 #endif
 
 #endif // RUNTIME_H
@@ -0,0 +1,48 @@
+// runtime/runtime_internal.h
+//
+// State shared between the runtime translation units. Nothing in here is
+// part of the interface seen by instrumented programs.
+
+#ifndef RUNTIME_INTERNAL_H
+#define RUNTIME_INTERNAL_H
+
+#include <stdint.h>
+
+// Ring records, shadow stack frames, calling-context nodes and live slots
+// all have room for MAX_EVENTS events and MAX_GROUPS counter groups,
+// whatever the run uses. 16 events cover a top-down set rotated over a
+// core's counters; builds that never count that many can save memory with
+// smaller values (-DMAX_EVENTS=n, -DMAX_GROUPS=n).
+#ifndef MAX_EVENTS
+#define MAX_EVENTS 16
+#endif
+#ifndef MAX_GROUPS
+#define MAX_GROUPS 8
+#endif
+#define MAX_NAME_LEN 128
+
+// How events that do not fit on the hardware together are counted.
+#define MULTIPLEX_NONE 0    // one group, counting all the time
+#define MULTIPLEX_ROTATE 1  // each thread switches between groups
+
+extern int num_events;
+extern char* event_names[MAX_EVENTS];
+extern int num_groups;
+extern int event_group[MAX_EVENTS];  // group of each event
+extern int multiplex_mode;
+
+// Estimate of a count taken while its group was counting for `running` of
+// `enabled` ns. Unknown (0) when the group never counted.
+static inline long long scale_count(long long count, uint64_t enabled, uint64_t running) {
+    if (running == 0) return 0;
+    if (running >= enabled) return count;
+    return (long long)((double)count * (double)enabled / (double)running);
+}
+
+// Estimate of event `i` over `enabled` ns, given the time each group was
+// counting; with a single group every event counted all along.
+static inline long long event_estimate(int i, long long count, uint64_t enabled, const uint64_t* running) {
+    return multiplex_mode == MULTIPLEX_ROTATE ? scale_count(count, enabled, running[event_group[i]]) : count;
+}
+
+#endif // RUNTIME_INTERNAL_H
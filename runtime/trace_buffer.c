@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
+
+#include "trace_buffer.h"
+#include "trace_writer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_BUFFER_RECORDS 65536
+#define DEFAULT_FLUSH_INTERVAL_US 1000
+#define MAX_CHUNK_RECORDS 4096
+
+static _Atomic(ThreadBuffer*) buffers = NULL;
+static uint64_t buffer_records = DEFAULT_BUFFER_RECORDS;
+static long flush_interval_us = DEFAULT_FLUSH_INTERVAL_US;
+
+static pthread_t writer_thread;
+static atomic_int writer_running = 0;
+static atomic_int writer_stop = 0;
+
+static uint64_t round_up_pow2(uint64_t v) {
+    uint64_t p = 1;
+    while (p < v) p <<= 1;
+    return p;
+}
+
+// Writes everything the producer has committed so far. Only ever called
+// from the writer thread (or after it has been joined).
+static uint64_t drain_buffer(ThreadBuffer* buf) {
+    uint64_t tail = atomic_load_explicit(&buf->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_acquire);
+    uint64_t n = head - tail;
+
+    while (tail != head) {
+        uint64_t end = head - tail > MAX_CHUNK_RECORDS ? tail + MAX_CHUNK_RECORDS : head;
+        trace_writer_begin_chunk(buf->thread_id);
+        for (; tail != end; ++tail) {
+            trace_writer_append(&buf->records[tail & buf->mask]);
+        }
+        trace_writer_end_chunk();
+        // Hand the slots back before encoding the next chunk.
+        atomic_store_explicit(&buf->tail, tail, memory_order_release);
+    }
+
+    // The owner has exited and will never produce again; once empty the
+    // buffer can be handed to the next new thread.
+    int expected = BUFFER_RETIRED;
+    if (n == 0 && atomic_load_explicit(&buf->state, memory_order_acquire) == BUFFER_RETIRED &&
+        atomic_load_explicit(&buf->head, memory_order_acquire) == tail) {
+        atomic_compare_exchange_strong(&buf->state, &expected, BUFFER_FREE);
+    }
+    return n;
+}
+
+static uint64_t drain_all(void) {
+    uint64_t total = 0;
+    for (ThreadBuffer* b = atomic_load(&buffers); b; b = b->next) {
+        total += drain_buffer(b);
+    }
+    return total;
+}
+
+static void* writer_main(void* arg) {
+    (void)arg;
+    struct timespec idle = {
+        .tv_sec = flush_interval_us / 1000000,
+        .tv_nsec = (flush_interval_us % 1000000) * 1000
+    };
+
+    for (;;) {
+        int stopping = atomic_load(&writer_stop);
+        if (drain_all() == 0) {
+            if (stopping) break;
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+void trace_buffer_init(void) {
+    const char* env = getenv("TRACE_BUFFER_RECORDS");
+    if (env && atoll(env) > 0) {
+        buffer_records = (uint64_t)atoll(env);
+    }
+    buffer_records = round_up_pow2(buffer_records);
+
+    env = getenv("TRACE_FLUSH_INTERVAL_US");
+    if (env && atol(env) > 0) {
+        flush_interval_us = atol(env);
+    }
+
+    const char* path = getenv("TRACE_OUTPUT");
+    if (!path || strlen(path) == 0) {
+        path = "function_metrics.cdlt";
+    }
+    if (!trace_writer_open(path)) {
+        fprintf(stderr, "Failed to open trace file %s\n", path);
+        exit(1);
+    }
+
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start trace writer thread\n");
+        exit(1);
+    }
+    atomic_store(&writer_running, 1);
+}
+
+ThreadBuffer* trace_buffer_acquire(void) {
+    // Reuse the buffer of a thread that has already exited, if any.
+    for (ThreadBuffer* b = atomic_load(&buffers); b; b = b->next) {
+        int expected = BUFFER_FREE;
+        if (atomic_compare_exchange_strong(&b->state, &expected, BUFFER_ACTIVE)) {
+            b->cached_tail = atomic_load_explicit(&b->tail, memory_order_acquire);
+            b->thread_id = (uint32_t)syscall(SYS_gettid);
+            return b;
+        }
+    }
+
+    ThreadBuffer* b = aligned_alloc(TRACE_CACHE_LINE, sizeof(ThreadBuffer));
+    TraceRecord* records = malloc(buffer_records * sizeof(TraceRecord));
+    if (!b || !records) {
+        fprintf(stderr, "Failed to allocate trace buffer\n");
+        exit(1);
+    }
+    memset(b, 0, sizeof(*b));
+    b->records = records;
+    b->mask = buffer_records - 1;
+    b->thread_id = (uint32_t)syscall(SYS_gettid);
+    atomic_init(&b->state, BUFFER_ACTIVE);
+
+    ThreadBuffer* old = atomic_load(&buffers);
+    do {
+        b->next = old;
+    } while (!atomic_compare_exchange_weak(&buffers, &old, b));
+    return b;
+}
+
+void trace_buffer_release(ThreadBuffer* buf) {
+    if (buf) {
+        atomic_store_explicit(&buf->state, BUFFER_RETIRED, memory_order_release);
+    }
+}
+
+void trace_buffer_shutdown(void) {
+    if (!atomic_load(&writer_running)) return;
+
+    atomic_store(&writer_stop, 1);
+    pthread_join(writer_thread, NULL);
+    atomic_store(&writer_running, 0);
+
+    // Catch anything committed between the writer's last pass and the join.
+    drain_all();
+
+    uint64_t dropped = trace_buffer_dropped();
+    if (dropped > 0) {
+        fprintf(stderr, "cd-lab: %llu records dropped (writer fell behind; raise TRACE_BUFFER_RECORDS)\n",
+                (unsigned long long)dropped);
+    }
+
+    trace_writer_close(dropped);
+}
+
+void trace_buffer_fork_child(void) {
+    if (!atomic_load(&writer_running)) return;
+    atomic_store(&writer_running, 0);
+    trace_writer_fork_child();
+}
+
+uint64_t trace_buffer_dropped(void) {
+    uint64_t dropped = 0;
+    for (ThreadBuffer* b = atomic_load(&buffers); b; b = b->next) {
+        dropped += atomic_load(&b->dropped);
+    }
+    return dropped;
+}
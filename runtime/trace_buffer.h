@@ -0,0 +1,94 @@
+// runtime/trace_buffer.h
+//
+// Per-thread single-producer/single-consumer ring buffers of call records.
+// Each instrumented thread owns one buffer and is its only producer; the
+// background writer thread is the only consumer and streams the records to
+// the output file while the program runs.
+
+#ifndef TRACE_BUFFER_H
+#define TRACE_BUFFER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "runtime_internal.h"
+
+#define TRACE_CACHE_LINE 64
+
+// One completed call, loop or region. start_ns and end_ns are the clock as
+// the probes read it; ns is the inclusive time with probe overhead removed.
+// counters[] are inclusive deltas; self_ns and self_counters[] exclude the
+// inclusive cost of instrumented callees. trips counts loop iterations (0 for functions). With rotation,
+// counts are what each event's group counted, and running_ns[] how long each
+// group was counting during the call; they are scaled when read.
+typedef struct {
+    uint32_t func_id;
+    uint32_t depth;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t ns;
+    uint64_t self_ns;
+    uint64_t trips;
+    long long counters[MAX_EVENTS];
+    long long self_counters[MAX_EVENTS];
+    uint64_t running_ns[MAX_GROUPS];
+} TraceRecord;
+
+enum {
+    BUFFER_ACTIVE = 0,   // owned by a live thread
+    BUFFER_RETIRED = 1,  // owner exited, writer still has records to drain
+    BUFFER_FREE = 2      // drained, may be claimed by a new thread
+};
+
+typedef struct ThreadBuffer {
+    // Producer side.
+    _Alignas(TRACE_CACHE_LINE) _Atomic uint64_t head;
+    uint64_t cached_tail;
+    _Atomic uint64_t dropped;
+
+    // Consumer side.
+    _Alignas(TRACE_CACHE_LINE) _Atomic uint64_t tail;
+
+    _Alignas(TRACE_CACHE_LINE) TraceRecord* records;
+    uint64_t mask;
+    uint32_t thread_id;  // kernel TID of the current owner
+    _Atomic int state;
+    struct ThreadBuffer* next;
+} ThreadBuffer;
+
+void trace_buffer_init(void);
+ThreadBuffer* trace_buffer_acquire(void);
+void trace_buffer_release(ThreadBuffer* buf);
+void trace_buffer_shutdown(void);
+
+// In a forked child, which has no writer thread: forgets the writer and the
+// parent's trace file, so that nothing joins the writer or touches the file.
+void trace_buffer_fork_child(void);
+
+// Records lost so far because a ring was full, summed over all threads.
+uint64_t trace_buffer_dropped(void);
+
+// Reserves the next slot of the ring, or returns NULL (and counts a drop)
+// when the writer has fallen a full ring behind. The slot becomes visible
+// to the writer on trace_buffer_commit().
+static inline TraceRecord* trace_buffer_reserve(ThreadBuffer* buf) {
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+    if (head - buf->cached_tail > buf->mask) {
+        buf->cached_tail = atomic_load_explicit(&buf->tail, memory_order_acquire);
+        if (head - buf->cached_tail > buf->mask) {
+            atomic_store_explicit(&buf->dropped,
+                                  atomic_load_explicit(&buf->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            return NULL;
+        }
+    }
+    return &buf->records[head & buf->mask];
+}
+
+static inline void trace_buffer_commit(ThreadBuffer* buf) {
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+    atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+}
+
+#endif // TRACE_BUFFER_H
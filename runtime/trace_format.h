@@ -0,0 +1,133 @@
+// runtime/trace_format.h
+//
+// On-disk layout of cd-lab binary traces (.cdlt), shared by the runtime that
+// writes them and cd_lab_trace that reads them. All fixed-width integers are
+// little-endian.
+//
+//   file header
+//     char[4]  magic "CDLT"
+//     u16      format version
+//     u16      reserved (0)
+//     u64      monotonic -> realtime offset in ns, taken when the trace opened
+//     u32      number of events
+//     per event: u16 length, name bytes
+//     u8 multiplex mode (MULTIPLEX_* from runtime_internal.h), u8 number of
+//     counter groups, per event: u8 group
+//
+//   then a sequence of blocks, each a u32 type and u32 payload size followed
+//   by the payload:
+//
+//   TRACE_BLOCK_THREAD_CHUNK  consecutive records from one thread
+//     varint thread id, varint record count, then per record:
+//       varint function id
+//       varint depth
+//       varint end_ns - previous end_ns in this chunk (end times of one
+//              thread never decrease; the first delta is from 0)
+//       varint end_ns - start_ns
+//       varint ns, the inclusive time with probe overhead removed
+//       varint self_ns
+//       varint trips (loop iterations, 0 for functions)
+//       per event: zigzag varint inclusive delta, zigzag varint self delta
+//       (with MULTIPLEX_ROTATE only) per group: varint ns
+//              the group was counting during the call; an event's deltas
+//              then cover only that time and are scaled by ns over it when
+//              read
+//
+//   TRACE_BLOCK_FUNCTIONS  the function table, written at shutdown
+//     varint count, then per function: varint id, string name, string
+//     mangled name, string file, varint line, string scope (strings are a
+//     varint length followed by the bytes), varint calls made, varint calls
+//     recorded (the two differ when throttling or sampling skipped calls),
+//     varint kind, one of RUNTIME_KIND_* from runtime.h
+//
+//   TRACE_BLOCK_END  always the last block of a cleanly closed trace
+//     u64 file offset of the FUNCTIONS block, u64 records written,
+//     u64 records dropped
+//
+// A trace cut short by a crash has no END block; readers still decode every
+// complete chunk and fall back to numeric function names.
+
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "CDLT"
+#define TRACE_FORMAT_VERSION 1
+
+#define TRACE_BLOCK_THREAD_CHUNK 1
+#define TRACE_BLOCK_FUNCTIONS 2
+#define TRACE_BLOCK_END 3
+
+#define TRACE_BLOCK_HEADER_SIZE 8
+#define TRACE_END_PAYLOAD_SIZE 24
+
+// Longest encoding of one 64-bit varint.
+#define TRACE_MAX_VARINT 10
+
+static inline size_t trace_put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    return 2;
+}
+
+static inline size_t trace_put_u32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = (uint8_t)(v >> (8 * i));
+    return 4;
+}
+
+static inline size_t trace_put_u64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) p[i] = (uint8_t)(v >> (8 * i));
+    return 8;
+}
+
+static inline uint16_t trace_get_u16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t trace_get_u32(const uint8_t* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+
+static inline uint64_t trace_get_u64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static inline size_t trace_put_varint(uint8_t* p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// Decodes one varint from [*p, end). Returns 0 on truncated input.
+static inline int trace_get_varint(const uint8_t** p, const uint8_t* end, uint64_t* v) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t byte = *(*p)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline uint64_t trace_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t trace_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+#endif // TRACE_FORMAT_H
@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include "trace_writer.h"
+#include "functions.h"
+#include "trace_format.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAP_WINDOW (64u << 20)
+#define MAX_RECORD_BYTES ((7 + 2 * MAX_EVENTS + MAX_GROUPS) * TRACE_MAX_VARINT)
+
+static int fd = -1;
+static uint8_t* map = NULL;
+static uint64_t map_offset = 0;  // file offset of map[0]
+static size_t map_len = 0;
+static uint64_t file_pos = 0;    // end of the data written so far
+
+// The record count precedes the records, so a chunk is encoded into this
+// scratch buffer first and appended in one piece.
+static uint8_t* chunk = NULL;
+static size_t chunk_cap = 0;
+static size_t chunk_len = 0;
+static uint32_t chunk_records = 0;
+static uint32_t chunk_thread = 0;
+static uint64_t chunk_prev_end = 0;
+
+static uint64_t records_written = 0;
+
+// Slides the window so that [pos, pos + need) is mapped, growing the file
+// ahead of the data. The slack is trimmed again in trace_writer_close().
+static int remap(uint64_t pos, size_t need) {
+    if (map) munmap(map, map_len);
+
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    map_offset = pos & ~(page - 1);
+    map_len = MAP_WINDOW;
+    while (pos - map_offset + need > map_len) map_len *= 2;
+
+    if (ftruncate(fd, (off_t)(map_offset + map_len)) != 0) {
+        perror("ftruncate");
+        map = NULL;
+        return 0;
+    }
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)map_offset);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        map = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static void append(const void* data, size_t n) {
+    if (file_pos + n > map_offset + map_len || !map) {
+        if (!remap(file_pos, n)) return;
+    }
+    memcpy(map + (file_pos - map_offset), data, n);
+    file_pos += n;
+}
+
+static void append_block(uint32_t type, const uint8_t* payload, size_t size) {
+    uint8_t header[TRACE_BLOCK_HEADER_SIZE];
+    trace_put_u32(header, type);
+    trace_put_u32(header + 4, (uint32_t)size);
+    append(header, sizeof(header));
+    append(payload, size);
+}
+
+static void reserve_chunk(size_t extra) {
+    if (chunk_len + extra <= chunk_cap) return;
+    size_t cap = chunk_cap ? chunk_cap : 1 << 16;
+    while (cap < chunk_len + extra) cap *= 2;
+    uint8_t* grown = realloc(chunk, cap);
+    if (!grown) {
+        fprintf(stderr, "Failed to grow trace chunk buffer\n");
+        exit(1);
+    }
+    chunk = grown;
+    chunk_cap = cap;
+}
+
+static size_t put_string(uint8_t* p, const char* s) {
+    size_t len = strlen(s);
+    size_t n = trace_put_varint(p, len);
+    memcpy(p + n, s, len);
+    return n + len;
+}
+
+int trace_writer_open(const char* path) {
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 0;
+    }
+
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t offset = ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000ll + (real.tv_nsec - mono.tv_nsec);
+
+    uint8_t header[22 + MAX_EVENTS * (3 + MAX_NAME_LEN)];
+    size_t n = 0;
+    memcpy(header, TRACE_MAGIC, 4);
+    n += 4;
+    n += trace_put_u16(header + n, TRACE_FORMAT_VERSION);
+    n += trace_put_u16(header + n, 0);
+    n += trace_put_u64(header + n, (uint64_t)offset);
+    n += trace_put_u32(header + n, (uint32_t)num_events);
+    for (int i = 0; i < num_events; ++i) {
+        size_t len = strnlen(event_names[i], MAX_NAME_LEN);
+        n += trace_put_u16(header + n, (uint16_t)len);
+        memcpy(header + n, event_names[i], len);
+        n += len;
+    }
+    header[n++] = (uint8_t)multiplex_mode;
+    header[n++] = (uint8_t)num_groups;
+    for (int i = 0; i < num_events; ++i) {
+        header[n++] = (uint8_t)event_group[i];
+    }
+    append(header, n);
+    return map != NULL;
+}
+
+void trace_writer_begin_chunk(uint32_t thread_id) {
+    chunk_len = 0;
+    chunk_records = 0;
+    chunk_thread = thread_id;
+    chunk_prev_end = 0;
+}
+
+void trace_writer_append(const TraceRecord* r) {
+    reserve_chunk(MAX_RECORD_BYTES);
+    uint8_t* p = chunk + chunk_len;
+    size_t n = 0;
+    n += trace_put_varint(p + n, r->func_id);
+    n += trace_put_varint(p + n, r->depth);
+    n += trace_put_varint(p + n, r->end_ns - chunk_prev_end);
+    n += trace_put_varint(p + n, r->end_ns - r->start_ns);
+    n += trace_put_varint(p + n, r->ns);
+    n += trace_put_varint(p + n, r->self_ns);
+    n += trace_put_varint(p + n, r->trips);
+    for (int i = 0; i < num_events; ++i) {
+        n += trace_put_varint(p + n, trace_zigzag(r->counters[i]));
+        n += trace_put_varint(p + n, trace_zigzag(r->self_counters[i]));
+    }
+    if (multiplex_mode == MULTIPLEX_ROTATE) {
+        for (int g = 0; g < num_groups; ++g) {
+            n += trace_put_varint(p + n, r->running_ns[g]);
+        }
+    }
+    chunk_len += n;
+    chunk_prev_end = r->end_ns;
+    chunk_records++;
+}
+
+void trace_writer_end_chunk(void) {
+    if (chunk_records == 0) return;
+
+    uint8_t prefix[2 * TRACE_MAX_VARINT];
+    size_t n = trace_put_varint(prefix, chunk_thread);
+    n += trace_put_varint(prefix + n, chunk_records);
+
+    uint8_t header[TRACE_BLOCK_HEADER_SIZE];
+    trace_put_u32(header, TRACE_BLOCK_THREAD_CHUNK);
+    trace_put_u32(header + 4, (uint32_t)(n + chunk_len));
+    append(header, sizeof(header));
+    append(prefix, n);
+    append(chunk, chunk_len);
+
+    records_written += chunk_records;
+    chunk_records = 0;
+    chunk_len = 0;
+}
+
+static void write_functions(void) {
+    // The reserved FUNCTION_UNREGISTERED entry is never called; leave it out.
+    uint32_t count = functions_count();
+    chunk_len = 0;
+    reserve_chunk(TRACE_MAX_VARINT);
+    chunk_len += trace_put_varint(chunk, count - (FUNCTION_UNREGISTERED + 1));
+
+    for (uint32_t id = FUNCTION_UNREGISTERED + 1; id < count; ++id) {
+        const RuntimeFunctionInfo* info = functions_get(id);
+        reserve_chunk(9 * TRACE_MAX_VARINT + strlen(info->name) + strlen(info->mangled_name) +
+                      strlen(info->file) + strlen(info->scope));
+        uint8_t* p = chunk + chunk_len;
+        size_t n = trace_put_varint(p, id);
+        n += put_string(p + n, info->name);
+        n += put_string(p + n, info->mangled_name);
+        n += put_string(p + n, info->file);
+        n += trace_put_varint(p + n, info->line);
+        n += put_string(p + n, info->scope);
+        n += trace_put_varint(p + n, atomic_load(&functions_entry(id)->calls));
+        n += trace_put_varint(p + n, atomic_load(&functions_entry(id)->recorded));
+        n += trace_put_varint(p + n, info->kind);
+        chunk_len += n;
+    }
+    append_block(TRACE_BLOCK_FUNCTIONS, chunk, chunk_len);
+    chunk_len = 0;
+}
+
+void trace_writer_close(uint64_t dropped) {
+    if (fd < 0) return;
+
+    uint64_t functions_offset = file_pos;
+    write_functions();
+
+    uint8_t end[TRACE_END_PAYLOAD_SIZE];
+    trace_put_u64(end, functions_offset);
+    trace_put_u64(end + 8, records_written);
+    trace_put_u64(end + 16, dropped);
+    append_block(TRACE_BLOCK_END, end, sizeof(end));
+
+    if (map) munmap(map, map_len);
+    map = NULL;
+    if (ftruncate(fd, (off_t)file_pos) != 0) {
+        perror("ftruncate");
+    }
+    close(fd);
+    fd = -1;
+
+    free(chunk);
+    chunk = NULL;
+    chunk_cap = 0;
+}
+
+void trace_writer_fork_child(void) {
+    if (fd < 0) return;
+    // The window is a shared mapping of the parent's file.
+    if (map) munmap(map, map_len);
+    map = NULL;
+    close(fd);
+    fd = -1;
+}
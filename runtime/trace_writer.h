@@ -0,0 +1,26 @@
+// runtime/trace_writer.h
+//
+// Encodes records into the binary format described in trace_format.h and
+// appends them to the trace file through a sliding mmap window. Only the
+// background writer thread calls into this module.
+
+#ifndef TRACE_WRITER_H
+#define TRACE_WRITER_H
+
+#include <stdint.h>
+
+#include "trace_buffer.h"
+
+int trace_writer_open(const char* path);
+
+void trace_writer_begin_chunk(uint32_t thread_id);
+void trace_writer_append(const TraceRecord* r);
+void trace_writer_end_chunk(void);
+
+// Appends the function table and END block, then trims the file to size.
+void trace_writer_close(uint64_t dropped);
+
+// In a forked child: lets go of the parent's file without writing to it.
+void trace_writer_fork_child(void);
+
+#endif // TRACE_WRITER_H
@@ -1,22 +1,28 @@
 #include <stdlib.h>
-static void __init_papi_env() __attribute__((constructor));
+static void __init_papi_env() __attribute__((constructor(101)));
 static void __init_papi_env() {
   setenv("TRACE_PAPI_EVENTS", "PAPI_L1_DCM,PAPI_TOT_CYC", 1);
 }
 
-#include "/home/bala/cd-lab/runtime/runtime.h"
+#include "runtime.h"
+static const RuntimeFunctionInfo __cdlab_functions[1] = {
+  { "square", "square", "test/simple_test.c", 1, "", RUNTIME_KIND_FUNCTION },
+};
+static uint32_t __cdlab_ids[1];
+static void __cdlab_register_functions() __attribute__((constructor(101)));
+static void __cdlab_register_functions() {
+  runtime_register_functions(__cdlab_functions, 1, __cdlab_ids);
+}
 
-int square(int n) {runtime_function_entry("square");
+int square(int n) {RUNTIME_SCOPE(__cdlab_ids[0]);
 
     
 
     int sum;
     if(n>2)
-     runtime_function_exit("square");
      return 0;
     for(int i=0;i<2000;i++)
      sum+=0;
-    runtime_function_exit("square");
     return sum;
 
 
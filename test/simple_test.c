@@ -1,5 +1,3 @@
-#include "/home/bala/cd-lab/runtime/runtime.h"
-
 int square(int n) {
     
 
@@ -1,6 +1,12 @@
+#include <atomic>
+#include <functional>
 #include <string>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <set>
+#include <tuple>
+#include <vector>
 
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
@@ -8,10 +14,25 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Rewrite/Core/Rewriter.h"
 #include "clang/AST/ASTConsumer.h"
+#include "clang/AST/Mangle.h"
 #include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/Pragma.h"
+#include "clang/Lex/Preprocessor.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
 
 using namespace clang;
 using namespace clang::tooling;
@@ -19,66 +40,584 @@ using namespace clang::ast_matchers;
 
 static llvm::cl::OptionCategory ToolCategory("cd-lab instrumentation options");
 static llvm::cl::opt<std::string> TraceEvents("trace-papi-events", llvm::cl::desc("Comma-separated list of PAPI events to trace"), llvm::cl::init("PAPI_TOT_INS,PAPI_L1_DCM"), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<std::string> AllowListFile("instrument-allowlist", llvm::cl::desc("File of fun:/src: patterns; only matching functions are instrumented"), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<std::string> DenyListFile("instrument-denylist", llvm::cl::desc("File of fun:/src: patterns; matching functions are not instrumented"), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<unsigned> MinStatements("min-statements", llvm::cl::desc("Skip functions with fewer statements than this"), llvm::cl::init(0), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<bool> SkipLeafFunctions("skip-leaf-functions", llvm::cl::desc("Skip functions that make no calls and contain no loops"), llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<bool> SkipInlineFunctions("skip-inline-functions", llvm::cl::desc("Skip functions declared inline"), llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<bool> InstrumentLoops("instrument-loops", llvm::cl::desc("Also instrument for, while and do loops inside instrumented functions"), llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<unsigned> LoopDepth("loop-depth", llvm::cl::desc("Deepest loop nesting level instrumented by -instrument-loops (default 1: outermost loops only)"), llvm::cl::init(1), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<std::string> OutputDir("output-dir", llvm::cl::desc("Instrument every TU of the compilation database and its project headers into this directory"), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<std::string> ProjectRoot("project-root", llvm::cl::desc("Files under this directory are mirrored into -output-dir (default: current directory)"), llvm::cl::init("."), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<std::string> CompileCommandsDir("compile-commands", llvm::cl::desc("Directory holding compile_commands.json when no source files are given (default: -project-root)"), llvm::cl::cat(ToolCategory));
+static llvm::cl::opt<unsigned> Jobs("j", llvm::cl::desc("Translation units instrumented in parallel (default: all cores)"), llvm::cl::init(0), llvm::cl::cat(ToolCategory));
+
+// Matches RUNTIME_KIND_* in runtime/runtime.h.
+enum ProbeKind { KindFunction, KindLoop, KindRegion };
+
+// One row of the per-TU metadata table; its index is the function's local ID.
+struct FunctionInfo {
+    std::string Name;
+    std::string MangledName;
+    std::string File;
+    unsigned Line;
+    std::string Scope;
+    ProbeKind Kind = KindFunction;
+};
+
+static std::string cStringLiteral(StringRef S) {
+    std::string Out = "\"";
+    for (char C : S) {
+        if (C == '"' || C == '\\') Out += '\\';
+        Out += C;
+    }
+    return Out + "\"";
+}
+
+// Sanitizer-style pattern list, one entry per line:
+//   fun:<glob>        function name or qualified name (ns::Class::method)
+//   src:<glob>        source file as passed to the compiler
+//   fun-regex:<re>    same, with an extended regular expression
+//   src-regex:<re>
+// Blank lines and lines starting with '#' are ignored.
+class PatternList {
+public:
+    bool load(StringRef Path, std::string &Error) {
+        auto Buffer = llvm::MemoryBuffer::getFile(Path);
+        if (!Buffer) {
+            Error = "cannot read " + Path.str() + ": " + Buffer.getError().message();
+            return false;
+        }
+
+        SmallVector<StringRef, 32> Lines;
+        (*Buffer)->getBuffer().split(Lines, '\n');
+        for (unsigned I = 0; I < Lines.size(); ++I) {
+            StringRef Line = Lines[I].trim();
+            if (Line.empty() || Line.startswith("#")) continue;
+
+            StringRef Kind, Pattern;
+            std::tie(Kind, Pattern) = Line.split(':');
+            std::string Where = Path.str() + ":" + std::to_string(I + 1);
+            if (Kind == "fun" || Kind == "src") {
+                auto Glob = llvm::GlobPattern::create(Pattern);
+                if (!Glob) {
+                    Error = Where + ": " + llvm::toString(Glob.takeError());
+                    return false;
+                }
+                (Kind == "fun" ? FunGlobs : SrcGlobs).push_back(std::move(*Glob));
+            } else if (Kind == "fun-regex" || Kind == "src-regex") {
+                llvm::Regex Re(Pattern);
+                std::string ReError;
+                if (!Re.isValid(ReError)) {
+                    Error = Where + ": " + ReError;
+                    return false;
+                }
+                (Kind == "fun-regex" ? FunRegexes : SrcRegexes).push_back(std::move(Re));
+            } else {
+                Error = Where + ": expected fun:, src:, fun-regex: or src-regex:";
+                return false;
+            }
+        }
+        Loaded = true;
+        return true;
+    }
+
+    bool loaded() const { return Loaded; }
+
+    bool matches(StringRef Name, StringRef QualifiedName, StringRef File) const {
+        for (const auto &G : FunGlobs)
+            if (G.match(Name) || G.match(QualifiedName)) return true;
+        for (const auto &G : SrcGlobs)
+            if (G.match(File)) return true;
+        for (const auto &R : FunRegexes)
+            if (R.match(Name) || R.match(QualifiedName)) return true;
+        for (const auto &R : SrcRegexes)
+            if (R.match(File)) return true;
+        return false;
+    }
+
+private:
+    bool Loaded = false;
+    std::vector<llvm::GlobPattern> FunGlobs, SrcGlobs;
+    std::vector<llvm::Regex> FunRegexes, SrcRegexes;
+};
+
+static PatternList AllowList;
+static PatternList DenyList;
+
+// A "#pragma cdlab <kind>" seen outside system headers. Arg is the name
+// given to region("name").
+struct PragmaMark {
+    SourceLocation Loc;
+    std::string Kind;
+    std::string Arg;
+};
+
+class CdlabPragmaHandler : public PragmaHandler {
+public:
+    CdlabPragmaHandler(std::vector<PragmaMark> &Marks) : PragmaHandler("cdlab"), Marks(Marks) {}
+
+    void HandlePragma(Preprocessor &PP, PragmaIntroducer Introducer, Token &FirstToken) override {
+        Token Tok;
+        PP.Lex(Tok);
+        if (Tok.isNot(tok::identifier) || Introducer.Kind != PIK_HashPragma) return;
+        if (PP.getSourceManager().isInSystemHeader(Introducer.Loc)) return;
+        PragmaMark Mark{Introducer.Loc, Tok.getIdentifierInfo()->getName().str(), ""};
+
+        if (Mark.Kind == "region") {
+            PP.Lex(Tok);
+            if (Tok.is(tok::l_paren)) PP.Lex(Tok);
+            if (Tok.is(tok::string_literal)) {
+                StringRef Literal(Tok.getLiteralData(), Tok.getLength());
+                Mark.Arg = Literal.drop_front(Literal.find('"') + 1).drop_back().str();
+            } else if (Tok.is(tok::identifier)) {
+                Mark.Arg = Tok.getIdentifierInfo()->getName().str();
+            }
+            if (Mark.Arg.empty()) {
+                PP.Diag(Tok.getLocation(), PP.getDiagnostics().getCustomDiagID(
+                                               DiagnosticsEngine::Warning, "expected region(\"name\")"));
+                return;
+            }
+        }
+        Marks.push_back(Mark);
+    }
+
+private:
+    std::vector<PragmaMark> &Marks;
+};
+
+// Size and shape of a function body, for the skip heuristics.
+class BodyShape : public RecursiveASTVisitor<BodyShape> {
+public:
+    unsigned Statements = 0;
+    bool HasCall = false;
+    bool HasLoop = false;
+
+    bool VisitStmt(Stmt *S) {
+        if (!isa<Expr>(S) && !isa<CompoundStmt>(S)) ++Statements;
+        if (isa<ForStmt>(S) || isa<WhileStmt>(S) || isa<DoStmt>(S) || isa<CXXForRangeStmt>(S))
+            HasLoop = true;
+        return true;
+    }
+
+    // Expression statements have no node of their own; they are counted
+    // where a statement goes: in blocks, and as unbraced branch, loop and
+    // label bodies.
+    bool VisitCompoundStmt(CompoundStmt *C) {
+        for (Stmt *Child : C->body()) countExpr(Child);
+        return true;
+    }
+    bool VisitIfStmt(IfStmt *S) { countExpr(S->getThen()); countExpr(S->getElse()); return true; }
+    bool VisitForStmt(ForStmt *S) { countExpr(S->getBody()); return true; }
+    bool VisitWhileStmt(WhileStmt *S) { countExpr(S->getBody()); return true; }
+    bool VisitDoStmt(DoStmt *S) { countExpr(S->getBody()); return true; }
+    bool VisitCXXForRangeStmt(CXXForRangeStmt *S) { countExpr(S->getBody()); return true; }
+    bool VisitSwitchStmt(SwitchStmt *S) { countExpr(S->getBody()); return true; }
+    bool VisitSwitchCase(SwitchCase *S) { countExpr(S->getSubStmt()); return true; }
+    bool VisitLabelStmt(LabelStmt *S) { countExpr(S->getSubStmt()); return true; }
+    bool VisitAttributedStmt(AttributedStmt *S) { countExpr(S->getSubStmt()); return true; }
+
+    bool VisitCallExpr(CallExpr *C) {
+        if (!C->getBuiltinCallee()) HasCall = true;
+        return true;
+    }
+
+    bool VisitCXXConstructExpr(CXXConstructExpr *C) {
+        if (!C->getConstructor()->isTrivial()) HasCall = true;
+        return true;
+    }
+
+    bool VisitCXXNewExpr(CXXNewExpr *) { HasCall = true; return true; }
+    bool VisitCXXDeleteExpr(CXXDeleteExpr *) { HasCall = true; return true; }
+
+    // A lambda's body belongs to its own call operator.
+    bool TraverseLambdaExpr(LambdaExpr *) { return true; }
+
+private:
+    void countExpr(const Stmt *S) {
+        if (S && isa<Expr>(S)) ++Statements;
+    }
+};
+
+// Per-TU instrumentation tallies, reported on stderr.
+struct SelectionStats {
+    unsigned Instrumented = 0;
+    unsigned Filtered = 0;
+    unsigned Trivial = 0;
+    unsigned Loops = 0;
+    unsigned Regions = 0;
+};
+
+static std::string realPathOf(const SourceManager &SM, FileID FID) {
+    const FileEntry *FE = SM.getFileEntryForID(FID);
+    if (!FE) return "";
+    if (!FE->tryGetRealPathName().empty()) return FE->tryGetRealPathName().str();
+    SmallString<256> Path(FE->getName());
+    // Relative to the compile command's directory, which is the working
+    // directory of the TU's own file system, not of the process.
+    SM.getFileManager().getVirtualFileSystem().makeAbsolute(Path);
+    llvm::sys::path::remove_dots(Path, true);
+    return std::string(Path.str());
+}
+
+// Shared by all TUs of a whole-project run (-output-dir). Every project file
+// is written by exactly one TU: main files by their own TU, headers by the
+// first TU that claims them.
+class ProjectContext {
+public:
+    ProjectContext(std::string Root, std::string OutDir) : Root(std::move(Root)), OutDir(std::move(OutDir)) {}
+
+    bool contains(StringRef Path) const {
+        return Path.startswith(Root + "/") && !Path.startswith(OutDir + "/");
+    }
+
+    std::string outputPathFor(StringRef Path) const { return OutDir + Path.substr(Root.size()).str(); }
+
+    bool claim(StringRef Path) {
+        if (!contains(Path)) return false;
+        std::lock_guard<std::mutex> Guard(Lock);
+        return Claimed.insert(Path.str()).second;
+    }
+
+    // Content hash of an input file, read once per run. Returns false if
+    // the file cannot be read.
+    bool contentHash(const std::string &Path, uint64_t &Hash) {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            auto It = Hashes.find(Path);
+            if (It != Hashes.end()) {
+                Hash = It->second;
+                return true;
+            }
+        }
+        auto Buffer = llvm::MemoryBuffer::getFile(Path);
+        if (!Buffer) return false;
+        Hash = llvm::xxHash64((*Buffer)->getBuffer());
+        std::lock_guard<std::mutex> Guard(Lock);
+        Hashes[Path] = Hash;
+        return true;
+    }
+
+    const std::string Root;
+    const std::string OutDir;
+
+private:
+    std::mutex Lock;
+    std::set<std::string> Claimed;
+    std::map<std::string, uint64_t> Hashes;
+};
+
+// Functions instrumented in one rewritten file, and the ID array their
+// probes index.
+struct FileTable {
+    std::string Suffix;  // "" for the main file, a path hash for headers
+    std::vector<FunctionInfo> Functions;
+
+    std::string idArray() const { return "__cdlab_ids" + Suffix; }
+};
+
+struct TUState {
+    ProjectContext *Project = nullptr;
+    std::map<FileID, FileTable> Tables;
+    std::set<FileID> Foreign;
+    std::vector<PragmaMark> Marks;
+    SelectionStats Stats;
+
+    // Probes only go into files whose rewritten text is written out: the
+    // main file and, in a whole-project run, the project headers this TU
+    // claims. Returns null for every other file.
+    FileTable *tableFor(const SourceManager &SM, FileID FID) {
+        auto It = Tables.find(FID);
+        if (It != Tables.end()) return &It->second;
+        if (Foreign.count(FID)) return nullptr;
+
+        if (FID == SM.getMainFileID()) return &Tables[FID];
+        if (Project && !SM.isInSystemHeader(SM.getLocForStartOfFile(FID))) {
+            std::string Path = realPathOf(SM, FID);
+            if (Project->claim(Path)) {
+                FileTable &Table = Tables[FID];
+                Table.Suffix = "_" + llvm::utohexstr(llvm::xxHash64(Path.substr(Project->Root.size())));
+                return &Table;
+            }
+        }
+        Foreign.insert(FID);
+        return nullptr;
+    }
+};
+
+// Finds labels and case labels a jump from outside `S` could target. Such
+// statements cannot be wrapped in a block holding a guard variable.
+class JumpTargetFinder : public RecursiveASTVisitor<JumpTargetFinder> {
+public:
+    bool Found = false;
+
+    bool VisitLabelStmt(LabelStmt *) {
+        Found = true;
+        return false;
+    }
+
+    bool VisitSwitchCase(SwitchCase *) {
+        if (SwitchDepth == 0) Found = true;
+        return !Found;
+    }
+
+    bool TraverseSwitchStmt(SwitchStmt *S) {
+        ++SwitchDepth;
+        bool Result = RecursiveASTVisitor::TraverseSwitchStmt(S);
+        --SwitchDepth;
+        return Result;
+    }
+
+private:
+    unsigned SwitchDepth = 0;
+};
+
+// Wraps loops (-instrument-loops) and statements marked with
+// "#pragma cdlab region(name)" inside one instrumented function body in
+// region probes:
+//
+//   { RUNTIME_REGION(ids[k], __cdlab_region_k); for (...) { __cdlab_region_k.trips++; ... } }
+class RegionInstrumenter : public RecursiveASTVisitor<RegionInstrumenter> {
+public:
+    RegionInstrumenter(Rewriter &R, FileTable &Table, const FunctionInfo &Parent,
+                       const std::vector<PragmaMark> &Marks, SelectionStats &Stats)
+        : TheRewriter(R), SM(R.getSourceMgr()), Table(Table), Parent(Parent), Marks(Marks), Stats(Stats) {}
+
+    bool TraverseStmt(Stmt *S) {
+        if (!S) return true;
+        if (auto *Compound = dyn_cast<CompoundStmt>(S)) attachRegions(Compound);
+
+        auto Region = Regions.find(S);
+        if (Region != Regions.end() && wrap(S, Region->second, KindRegion, nullptr)) ++Stats.Regions;
+
+        const Stmt *LoopBody = loopBody(S);
+        if (LoopBody && InstrumentLoops && Depth < LoopDepth && wrap(S, loopName(S), KindLoop, LoopBody))
+            ++Stats.Loops;
+
+        if (LoopBody) ++Depth;
+        bool Result = RecursiveASTVisitor::TraverseStmt(S);
+        if (LoopBody) --Depth;
+        return Result;
+    }
+
+    // Lambdas and local classes are instrumented as functions of their own.
+    bool TraverseLambdaExpr(LambdaExpr *) { return true; }
+    bool TraverseCXXRecordDecl(CXXRecordDecl *) { return true; }
+
+private:
+    static const Stmt *loopBody(const Stmt *S) {
+        if (const auto *For = dyn_cast<ForStmt>(S)) return For->getBody();
+        if (const auto *While = dyn_cast<WhileStmt>(S)) return While->getBody();
+        if (const auto *Do = dyn_cast<DoStmt>(S)) return Do->getBody();
+        if (const auto *Range = dyn_cast<CXXForRangeStmt>(S)) return Range->getBody();
+        return nullptr;
+    }
+
+    std::string loopName(const Stmt *S) {
+        const char *Keyword = isa<WhileStmt>(S) ? "while" : isa<DoStmt>(S) ? "do" : "for";
+        return std::string(Keyword) + "@" + std::to_string(SM.getPresumedLineNumber(S->getBeginLoc()));
+    }
+
+    // A region pragma applies to the statement that follows it in the same
+    // block.
+    void attachRegions(const CompoundStmt *Compound) {
+        SourceLocation Prev = Compound->getLBracLoc();
+        for (const Stmt *Child : Compound->body()) {
+            SourceLocation Begin = SM.getExpansionLoc(Child->getBeginLoc());
+            for (const PragmaMark &M : Marks) {
+                if (M.Kind == "region" && SM.isBeforeInTranslationUnit(Prev, M.Loc) &&
+                    SM.isBeforeInTranslationUnit(M.Loc, Begin))
+                    Regions[Child] = M.Arg;
+            }
+            Prev = SM.getExpansionLoc(Child->getEndLoc());
+        }
+    }
+
+    // First location past `S`, including the ';' that ends it.
+    SourceLocation endOf(const Stmt *S) {
+        SourceLocation End = S->getEndLoc();
+        if (End.isMacroID()) return SourceLocation();
+        const LangOptions &LO = TheRewriter.getLangOpts();
+        SourceLocation AfterSemi = Lexer::findLocationAfterToken(End, tok::semi, SM, LO, false);
+        return AfterSemi.isValid() ? AfterSemi : Lexer::getLocForEndOfToken(End, 0, SM, LO);
+    }
+
+    bool wrap(const Stmt *S, const std::string &Name, ProbeKind Kind, const Stmt *LoopBody) {
+        SourceLocation Begin = S->getBeginLoc();
+        SourceLocation End = endOf(S);
+        JumpTargetFinder Jumps;
+        Jumps.TraverseStmt(const_cast<Stmt *>(S));
+        // A block around a declaration would end its scope early.
+        if (Begin.isMacroID() || End.isInvalid() || Jumps.Found || isa<DeclStmt>(S)) {
+            llvm::errs() << S->getBeginLoc().printToString(SM) << ": warning: cannot instrument " << Name << "\n";
+            return false;
+        }
+
+        unsigned Id = Table.Functions.size();
+        FunctionInfo Info;
+        Info.Name = Name;
+        Info.Kind = Kind;
+        PresumedLoc PLoc = SM.getPresumedLoc(Begin);
+        Info.File = PLoc.isValid() ? PLoc.getFilename() : "";
+        Info.Line = PLoc.isValid() ? PLoc.getLine() : 0;
+        Info.Scope = Parent.Scope.empty() ? Parent.Name : Parent.Scope + "::" + Parent.Name;
+        Info.MangledName = Parent.MangledName + "." + Name + ":" + std::to_string(PLoc.isValid() ? PLoc.getColumn() : 0);
+        Table.Functions.push_back(Info);
+
+        // Openings go after, closings before, earlier insertions at the same
+        // spot, so that the blocks of nested statements nest properly.
+        std::string Var = "__cdlab_region_" + std::to_string(Id);
+        TheRewriter.InsertText(Begin, "{ RUNTIME_REGION(" + Table.idArray() + "[" + std::to_string(Id) + "], " +
+                                          Var + "); ", true);
+        TheRewriter.InsertText(End, " }", false);
+
+        if (!LoopBody) return true;
+        std::string Trip = Var + ".trips++;";
+        if (const auto *Compound = dyn_cast<CompoundStmt>(LoopBody)) {
+            TheRewriter.InsertText(Compound->getLBracLoc().getLocWithOffset(1), " " + Trip, true);
+        } else {
+            TheRewriter.InsertText(LoopBody->getBeginLoc(), "{ " + Trip + " ", true);
+            TheRewriter.InsertText(endOf(LoopBody), " }", false);
+        }
+        return true;
+    }
+
+    Rewriter &TheRewriter;
+    SourceManager &SM;
+    FileTable &Table;
+    const FunctionInfo &Parent;
+    const std::vector<PragmaMark> &Marks;
+    SelectionStats &Stats;
+    std::map<const Stmt *, std::string> Regions;
+    unsigned Depth = 0;
+};
 
 class InstrumentorCallback : public MatchFinder::MatchCallback {
 public:
-    InstrumentorCallback(Rewriter &R) : TheRewriter(R) {}
+    InstrumentorCallback(Rewriter &R, TUState &State) : TheRewriter(R), State(State) {}
 
     void run(const MatchFinder::MatchResult &Result) override {
         const FunctionDecl *Func = Result.Nodes.getNodeAs<FunctionDecl>("funcDecl");
-        if (!Func || !Func->hasBody() || Func->isMain()) return;
+        if (!Func || !Func->hasBody()) return;
+        // Instantiations share their template's source text; instrument the
+        // pattern once.
+        if (Func->isTemplateInstantiation()) return;
 
         const Stmt *Body = Func->getBody();
         SourceManager &SM = *Result.SourceManager;
 
-        std::string FuncName = Func->getNameInfo().getName().getAsString();
-        std::string entryCall = "runtime_function_entry(\"" + FuncName + "\");\n";
-        std::string exitCall = "runtime_function_exit(\"" + FuncName + "\");\n";
+        Override Forced = overrideFor(Func, SM);
+        if (Func->isMain() || Body->getBeginLoc().isMacroID()) return;
+        // The probe is a local guard object: it needs a plain body to live in
+        // (not a function-try-block or coroutine) and cannot appear in
+        // constexpr or naked functions.
+        if (!isa<CompoundStmt>(Body) || Func->isConstexpr() || Func->hasAttr<NakedAttr>()) return;
 
-        SourceLocation StartLoc = Body->getBeginLoc().getLocWithOffset(1);
-        TheRewriter.InsertText(StartLoc, entryCall, true, true);
-
-        class ReturnVisitor : public RecursiveASTVisitor<ReturnVisitor> {
-        public:
-            ReturnVisitor(Rewriter &R, const std::string &exitCall, SourceManager &SM)
-                : TheRewriter(R), ExitCall(exitCall), SM(SM) {}
-
-            bool VisitReturnStmt(ReturnStmt *Ret) {
-                SourceLocation RetLoc = Ret->getBeginLoc();
-                if (RetLoc.isValid() && !SM.isInSystemHeader(RetLoc)) {
-                    TheRewriter.InsertText(RetLoc, ExitCall, true, true);
-                    FoundReturn = true;
-                }
-                return true;
+        FileTable *Table = State.tableFor(SM, SM.getFileID(Body->getBeginLoc()));
+        if (!Table) return;
+
+        SelectionStats &Stats = State.Stats;
+        FunctionInfo Info = describe(Func, *Result.Context, SM);
+        if (Forced == Override::Skip) {
+            ++Stats.Filtered;
+            return;
+        }
+        if (Forced == Override::None) {
+            std::string Qualified = Func->getQualifiedNameAsString();
+            if ((AllowList.loaded() && !AllowList.matches(Info.Name, Qualified, Info.File)) ||
+                (DenyList.loaded() && DenyList.matches(Info.Name, Qualified, Info.File))) {
+                ++Stats.Filtered;
+                return;
             }
+            if (isTrivial(Func, Body)) {
+                ++Stats.Trivial;
+                return;
+            }
+        }
+        ++Stats.Instrumented;
+
+        unsigned FuncID = Table->Functions.size();
+        Table->Functions.push_back(Info);
+
+        // One guard at the top of the body closes the call on every path out
+        // of the function, after the return value has been computed.
+        std::string IdExpr = Table->idArray() + "[" + std::to_string(FuncID) + "]";
+        SourceLocation StartLoc = Body->getBeginLoc().getLocWithOffset(1);
+        TheRewriter.InsertText(StartLoc, "RUNTIME_SCOPE(" + IdExpr + ");\n", true, true);
 
-            bool foundReturn() const { return FoundReturn; }
+        RegionInstrumenter Regions(TheRewriter, *Table, Info, State.Marks, Stats);
+        Regions.TraverseStmt(const_cast<Stmt *>(Body));
+    }
 
-        private:
-            Rewriter &TheRewriter;
-            const std::string &ExitCall;
-            SourceManager &SM;
-            bool FoundReturn = false;
-        };
+private:
+    enum class Override { None, Force, Skip };
 
-        ReturnVisitor visitor(TheRewriter, exitCall, SM);
-        visitor.TraverseStmt(const_cast<Stmt*>(Body));
+    // annotate("cdlab_no_instrument") / annotate("cdlab_instrument") on any
+    // declaration, or "#pragma cdlab no_instrument" / "#pragma cdlab
+    // instrument" before the definition in the same file, override lists
+    // and heuristics. Called for every definition so that each pragma
+    // applies to exactly one function.
+    Override overrideFor(const FunctionDecl *Func, SourceManager &SM) {
+        Override Result = Override::None;
+        SourceLocation Begin = SM.getExpansionLoc(Func->getBeginLoc());
+        const std::vector<PragmaMark> &Marks = State.Marks;
+        for (; NextMark < Marks.size(); ++NextMark) {
+            const PragmaMark &M = Marks[NextMark];
+            if (!SM.isBeforeInTranslationUnit(M.Loc, Begin)) break;
+            if (SM.getFileID(M.Loc) != SM.getFileID(Begin)) continue;
+            if (M.Kind == "instrument") Result = Override::Force;
+            else if (M.Kind == "no_instrument") Result = Override::Skip;
+        }
 
-        if (!visitor.foundReturn()) {
-            if (const CompoundStmt *Compound = dyn_cast<CompoundStmt>(Body)) {
-                SourceLocation EndLoc = Compound->getRBracLoc();
-                TheRewriter.InsertTextBefore(EndLoc, exitCall);
+        for (const FunctionDecl *D : Func->redecls()) {
+            for (const auto *A : D->specific_attrs<AnnotateAttr>()) {
+                if (A->getAnnotation() == "cdlab_no_instrument") return Override::Skip;
+                if (A->getAnnotation() == "cdlab_instrument") Result = Override::Force;
             }
         }
+        return Result;
+    }
+
+    // Functions whose probes would cost more than the work they measure.
+    bool isTrivial(const FunctionDecl *Func, const Stmt *Body) {
+        if (SkipInlineFunctions && Func->isInlineSpecified()) return true;
+
+        BodyShape Shape;
+        Shape.TraverseStmt(const_cast<Stmt *>(Body));
+        if (Shape.Statements < MinStatements) return true;
+        return SkipLeafFunctions && !Shape.HasCall && !Shape.HasLoop;
+    }
+
+    FunctionInfo describe(const FunctionDecl *Func, ASTContext &Ctx, SourceManager &SM) {
+        if (!NameGen || NameGenCtx != &Ctx) {
+            NameGen = std::make_unique<ASTNameGenerator>(Ctx);
+            NameGenCtx = &Ctx;
+        }
+
+        FunctionInfo Info;
+        Info.Name = Func->getNameInfo().getName().getAsString();
+        Info.MangledName = NameGen->getName(Func);
+        if (Info.MangledName.empty()) Info.MangledName = Info.Name;
+
+        PresumedLoc PLoc = SM.getPresumedLoc(SM.getExpansionLoc(Func->getLocation()));
+        Info.File = PLoc.isValid() ? PLoc.getFilename() : "";
+        Info.Line = PLoc.isValid() ? PLoc.getLine() : 0;
+
+        if (const auto *Parent = dyn_cast<NamedDecl>(Func->getDeclContext()))
+            Info.Scope = Parent->getQualifiedNameAsString();
+        return Info;
     }
 
-private:
     Rewriter &TheRewriter;
+    TUState &State;
+    size_t NextMark = 0;
+    std::unique_ptr<ASTNameGenerator> NameGen;
+    ASTContext *NameGenCtx = nullptr;
 };
 
 class InstrumentorASTConsumer : public ASTConsumer {
 public:
-    InstrumentorASTConsumer(Rewriter &R) : Handler(R) {
+    InstrumentorASTConsumer(Rewriter &R, TUState &State) : Handler(R, State) {
         Matcher.addMatcher(
             functionDecl(isDefinition(), unless(isExpansionInSystemHeader())).bind("funcDecl"),
             &Handler
@@ -94,45 +633,389 @@ private:
     MatchFinder Matcher;
 };
 
+// Metadata table: probes pass only an index into the ID array, which the
+// runtime fills with process-wide IDs when the TU is loaded. Registration
+// runs ahead of default-priority constructors and static initializers, so
+// those can call instrumented code; anything earlier still sees ID 0, which
+// the probes ignore.
+static std::string emitTable(const FileTable &Table) {
+    std::string Count = std::to_string(Table.Functions.size());
+    std::string Code;
+    Code += "#include \"runtime.h\"\n";
+    Code += "static const RuntimeFunctionInfo __cdlab_functions" + Table.Suffix + "[" + Count + "] = {\n";
+    for (const FunctionInfo &F : Table.Functions) {
+        static const char *const KindNames[] = {"RUNTIME_KIND_FUNCTION", "RUNTIME_KIND_LOOP", "RUNTIME_KIND_REGION"};
+        Code += "  { " + cStringLiteral(F.Name) + ", " + cStringLiteral(F.MangledName) + ", " +
+                cStringLiteral(F.File) + ", " + std::to_string(F.Line) + ", " + cStringLiteral(F.Scope) + ", " +
+                KindNames[F.Kind] + " },\n";
+    }
+    Code += "};\n";
+    // A header's table is compiled into every TU that includes it. Each copy
+    // registers the same entries, so they all resolve to the same IDs and can
+    // share one weak array, which inline functions may reference.
+    if (Table.Suffix.empty()) Code += "static uint32_t " + Table.idArray() + "[" + Count + "];\n";
+    else Code += "uint32_t " + Table.idArray() + "[" + Count + "] __attribute__((weak));\n";
+    std::string Register = "__cdlab_register_functions" + Table.Suffix;
+    Code += "static void " + Register + "() __attribute__((constructor(101)));\n";
+    Code += "static void " + Register + "() {\n";
+    Code += "  runtime_register_functions(__cdlab_functions" + Table.Suffix + ", " + Count + ", " +
+            Table.idArray() + ");\n";
+    Code += "}\n\n";
+    return Code;
+}
+
+static bool writeFile(const std::string &Path, const std::function<void(llvm::raw_ostream &)> &Write) {
+    llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path));
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC);
+    if (EC) {
+        llvm::errs() << "cannot write " << Path << ": " << EC.message() << "\n";
+        return false;
+    }
+    Write(OS);
+    return true;
+}
+
 class InstrumentorFrontendAction : public ASTFrontendAction {
 public:
+    // Without a project the rewritten main file goes to stdout. With one,
+    // rewritten and touched project files go to the output directory and
+    // every file the TU read is appended to Deps.
+    InstrumentorFrontendAction(ProjectContext *Project = nullptr, std::vector<std::string> *Deps = nullptr)
+        : Project(Project), Deps(Deps) {}
+
     std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, StringRef file) override {
         TheRewriter.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
-        return std::make_unique<InstrumentorASTConsumer>(TheRewriter);
+        State = TUState();
+        State.Project = Project;
+        // The preprocessor takes ownership of the handler.
+        CI.getPreprocessor().AddPragmaHandler(new CdlabPragmaHandler(State.Marks));
+        return std::make_unique<InstrumentorASTConsumer>(TheRewriter, State);
     }
 
     void EndSourceFileAction() override {
         SourceManager &SM = TheRewriter.getSourceMgr();
         FileID MainFileID = SM.getMainFileID();
+        const SelectionStats &Stats = State.Stats;
         llvm::errs() << "** Finished instrumenting: "
-                     << SM.getFileEntryForID(MainFileID)->getName() << "\n";
+                     << SM.getFileEntryForID(MainFileID)->getName() << " (" << Stats.Instrumented
+                     << " functions instrumented, " << Stats.Loops << " loops, " << Stats.Regions << " regions, "
+                     << Stats.Filtered << " filtered, " << Stats.Trivial << " skipped as trivial)\n";
 
-        // Inject setenv logic
-        std::string InitCode;
-        InitCode += "#include <stdlib.h>\n";
-        InitCode += "static void __init_papi_env() __attribute__((constructor));\n";
-        InitCode += "static void __init_papi_env() {\n";
-        InitCode += "  setenv(\"TRACE_PAPI_EVENTS\", \"" + TraceEvents + "\", 1);\n";
-        InitCode += "}\n\n";
+        // Our pragmas mean nothing to the compiler that builds the output.
+        for (const PragmaMark &M : State.Marks) {
+            if (State.Tables.count(SM.getFileID(M.Loc))) TheRewriter.InsertText(M.Loc, "// ", false);
+        }
 
-        TheRewriter.InsertText(SM.getLocForStartOfFile(MainFileID), InitCode, true, true);
-        TheRewriter.getEditBuffer(MainFileID).write(llvm::outs());
+        // The main file gets the setenv constructor even when nothing in it
+        // was instrumented.
+        State.tableFor(SM, MainFileID);
+        for (auto &Entry : State.Tables) {
+            const FileTable &Table = Entry.second;
+            std::string InitCode;
+            if (Entry.first == MainFileID) {
+                // Inject setenv logic
+                InitCode += "#include <stdlib.h>\n";
+                InitCode += "static void __init_papi_env() __attribute__((constructor(101)));\n";
+                InitCode += "static void __init_papi_env() {\n";
+                InitCode += "  setenv(\"TRACE_PAPI_EVENTS\", \"" + TraceEvents + "\", 1);\n";
+                InitCode += "}\n\n";
+                if (!Table.Functions.empty()) InitCode += emitTable(Table);
+            } else if (!Table.Functions.empty()) {
+                std::string Guard = "__CDLAB_TABLE" + Table.Suffix;
+                InitCode += "#ifndef " + Guard + "\n#define " + Guard + "\n";
+                InitCode += emitTable(Table);
+                InitCode += "#endif\n";
+            }
+            if (!InitCode.empty()) TheRewriter.InsertText(SM.getLocForStartOfFile(Entry.first), InitCode, true, true);
+        }
+
+        if (!Project) {
+            TheRewriter.getEditBuffer(MainFileID).write(llvm::outs());
+            return;
+        }
+
+        for (auto &Entry : State.Tables) {
+            std::string Path = realPathOf(SM, Entry.first);
+            if (!Project->contains(Path)) {
+                llvm::errs() << Path << " is outside the project root " << Project->Root << "\n";
+                continue;
+            }
+            writeFile(Project->outputPathFor(Path),
+                      [&](llvm::raw_ostream &OS) { TheRewriter.getEditBuffer(Entry.first).write(OS); });
+        }
+
+        // Project files nobody instruments are mirrored unchanged, so that the
+        // output directory builds on its own.
+        for (auto I = SM.fileinfo_begin(), E = SM.fileinfo_end(); I != E; ++I) {
+            const FileEntry *FE = I->first;
+            std::string Path = FE->tryGetRealPathName().str();
+            if (Path.empty()) continue;
+            if (Deps) Deps->push_back(Path);
+            if (!Project->claim(Path)) continue;
+            std::string Out = Project->outputPathFor(Path);
+            llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Out));
+            if (std::error_code EC = llvm::sys::fs::copy_file(Path, Out))
+                llvm::errs() << "cannot copy " << Path << ": " << EC.message() << "\n";
+        }
     }
 
 private:
+    ProjectContext *Project;
+    std::vector<std::string> *Deps;
     Rewriter TheRewriter;
+    TUState State;
+};
+
+class ProjectActionFactory : public FrontendActionFactory {
+public:
+    ProjectActionFactory(ProjectContext &Project, std::vector<std::string> &Deps) : Project(Project), Deps(Deps) {}
+
+    std::unique_ptr<FrontendAction> create() override {
+        return std::make_unique<InstrumentorFrontendAction>(&Project, &Deps);
+    }
+
+private:
+    ProjectContext &Project;
+    std::vector<std::string> &Deps;
 };
 
+// Incremental state of a whole-project run, kept in <output-dir>/.cdlab_cache.
+// A TU is skipped when the hash of its compile command, the instrumentor
+// options and the contents of every file it read last time is unchanged.
+//
+//   S <16 hex digits> <source path>
+//   D <dependency path>     (one line per file the TU read)
+struct CacheEntry {
+    uint64_t Hash = 0;
+    std::vector<std::string> Deps;
+};
+
+static std::map<std::string, CacheEntry> loadCache(const std::string &Path) {
+    std::map<std::string, CacheEntry> Cache;
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer) return Cache;
+
+    SmallVector<StringRef, 0> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+    CacheEntry *Current = nullptr;
+    for (StringRef Line : Lines) {
+        if (Line.startswith("S ") && Line.size() > 19) {
+            Current = &Cache[Line.substr(19).str()];
+            if (Line.substr(2, 16).getAsInteger(16, Current->Hash)) Current->Hash = 0;
+        } else if (Line.startswith("D ") && Current) {
+            Current->Deps.push_back(Line.substr(2).str());
+        }
+    }
+    return Cache;
+}
+
+static void saveCache(const std::string &Path, const std::map<std::string, CacheEntry> &Cache) {
+    writeFile(Path, [&](llvm::raw_ostream &OS) {
+        for (const auto &Entry : Cache) {
+            OS << "S " << llvm::format_hex_no_prefix(Entry.second.Hash, 16) << " " << Entry.first << "\n";
+            for (const std::string &Dep : Entry.second.Deps) OS << "D " << Dep << "\n";
+        }
+    });
+}
+
+// Everything besides the inputs' contents that changes the output.
+static std::string optionsKey(ProjectContext &Project) {
+    std::string Key;
+    for (const std::string &Part : {std::string("cdlab-2"), TraceEvents.getValue(), std::to_string(MinStatements),
+                                    std::to_string(SkipLeafFunctions), std::to_string(SkipInlineFunctions),
+                                    std::to_string(InstrumentLoops), std::to_string(LoopDepth),
+                                    Project.Root, Project.OutDir})
+        Key += Part + '\0';
+    for (const std::string &List : {AllowListFile.getValue(), DenyListFile.getValue()}) {
+        uint64_t Hash = 0;
+        if (!List.empty()) Project.contentHash(List, Hash);
+        Key += std::to_string(Hash) + '\0';
+    }
+    return Key;
+}
+
+static std::string commandKey(const CompilationDatabase &Compilations, StringRef File) {
+    std::string Key;
+    for (const CompileCommand &Command : Compilations.getCompileCommands(File)) {
+        Key += Command.Directory + '\0';
+        for (const std::string &Arg : Command.CommandLine) Key += Arg + '\0';
+    }
+    return Key;
+}
+
+// Returns 0 if a dependency can no longer be read.
+static uint64_t hashInputs(ProjectContext &Project, const std::string &Key, const std::vector<std::string> &Deps) {
+    std::string Buf = Key;
+    for (const std::string &Dep : Deps) {
+        uint64_t Hash;
+        if (!Project.contentHash(Dep, Hash)) return 0;
+        Buf += Dep + '\0' + std::to_string(Hash) + '\0';
+    }
+    return llvm::xxHash64(Buf);
+}
+
+// compile_commands.json for the mirrored tree. A path under the project
+// root, alone or as the value of an option (-I/root/include,
+// --sysroot=/root), moves to the output directory; only whole components
+// match, so /root leaves /root2 alone. Everything else, including build
+// directories outside the root, stays where it is, and the source file is
+// made absolute so that it still names the rewritten copy from there.
+static void writeCompilationDatabase(const ProjectContext &Project, const CompilationDatabase &Compilations,
+                                     const std::vector<std::string> &Files) {
+    auto Remap = [&](const std::string &S) {
+        size_t Start = 0;
+        if (!S.empty() && S[0] == '-') {
+            Start = S.find('/');
+            if (Start == std::string::npos) return S;
+        }
+        StringRef Path = StringRef(S).substr(Start);
+        if (Path != Project.Root && !Path.startswith(Project.Root + "/")) return S;
+        return S.substr(0, Start) + Project.OutDir + Path.substr(Project.Root.size()).str();
+    };
+
+    writeFile(Project.OutDir + "/compile_commands.json", [&](llvm::raw_ostream &OS) {
+        llvm::json::OStream J(OS, 2);
+        J.array([&] {
+            for (const std::string &File : Files) {
+                for (const CompileCommand &Command : Compilations.getCompileCommands(File)) {
+                    SmallString<256> Source(Command.Filename);
+                    llvm::sys::fs::make_absolute(Command.Directory, Source);
+                    llvm::sys::path::remove_dots(Source, true);
+                    std::string Directory = Remap(Command.Directory);
+                    // Nothing was mirrored into a build directory under the root.
+                    if (Directory != Command.Directory) llvm::sys::fs::create_directories(Directory);
+
+                    J.object([&] {
+                        J.attribute("directory", Directory);
+                        J.attribute("file", Remap(std::string(Source.str())));
+                        J.attributeArray("arguments", [&] {
+                            for (const std::string &Arg : Command.CommandLine)
+                                J.value(Remap(Arg == Command.Filename ? std::string(Source.str()) : Arg));
+                        });
+                    });
+                }
+            }
+        });
+        OS << "\n";
+    });
+}
+
+static int instrumentProject(const CompilationDatabase &Compilations, std::vector<std::string> Files) {
+    SmallString<256> Root, Out;
+    if (llvm::sys::fs::real_path(ProjectRoot, Root)) {
+        llvm::errs() << "cannot resolve project root " << ProjectRoot << "\n";
+        return 1;
+    }
+    if (llvm::sys::fs::create_directories(OutputDir) || llvm::sys::fs::real_path(OutputDir, Out)) {
+        llvm::errs() << "cannot create output directory " << OutputDir << "\n";
+        return 1;
+    }
+    ProjectContext Project(std::string(Root.str()), std::string(Out.str()));
+
+    if (Files.empty()) Files = Compilations.getAllFiles();
+    std::vector<std::string> MainPaths(Files.size());
+    for (size_t I = 0; I < Files.size(); ++I) {
+        SmallString<256> Path;
+        if (llvm::sys::fs::real_path(Files[I], Path)) Path = Files[I];
+        MainPaths[I] = std::string(Path.str());
+        // Main files are written by their own TU, never copied as headers.
+        Project.claim(MainPaths[I]);
+    }
+
+    std::string CachePath = Project.OutDir + "/.cdlab_cache";
+    std::map<std::string, CacheEntry> Cache = loadCache(CachePath);
+    std::string Options = optionsKey(Project);
+    std::mutex CacheLock;
+    std::atomic<unsigned> Unchanged{0}, Failed{0};
+
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+    for (size_t I = 0; I < Files.size(); ++I) {
+        Pool.async([&, I] {
+            const std::string &File = Files[I];
+            if (!Project.contains(MainPaths[I])) {
+                llvm::errs() << File << " is outside the project root " << Project.Root << "\n";
+                ++Failed;
+                return;
+            }
+            std::string Key = Options + commandKey(Compilations, File);
+
+            CacheEntry Previous;
+            {
+                std::lock_guard<std::mutex> Guard(CacheLock);
+                auto It = Cache.find(File);
+                if (It != Cache.end()) Previous = It->second;
+            }
+            if (Previous.Hash != 0 && hashInputs(Project, Key, Previous.Deps) == Previous.Hash &&
+                llvm::sys::fs::exists(Project.outputPathFor(MainPaths[I]))) {
+                ++Unchanged;
+                return;
+            }
+
+            // ClangTool::run moves to each command's directory. On the real
+            // file system that is the process-wide working directory, which
+            // other TUs share; a physical file system of its own keeps the
+            // move to this TU.
+            CacheEntry Entry;
+            ClangTool Tool(Compilations, {File}, std::make_shared<PCHContainerOperations>(),
+                           llvm::vfs::createPhysicalFileSystem());
+            ProjectActionFactory Factory(Project, Entry.Deps);
+            if (Tool.run(&Factory) != 0) {
+                ++Failed;
+                std::lock_guard<std::mutex> Guard(CacheLock);
+                Cache.erase(File);
+                return;
+            }
+            Entry.Hash = hashInputs(Project, Key, Entry.Deps);
+            std::lock_guard<std::mutex> Guard(CacheLock);
+            Cache[File] = std::move(Entry);
+        });
+    }
+    Pool.wait();
+
+    saveCache(CachePath, Cache);
+    writeCompilationDatabase(Project, Compilations, Files);
+    llvm::errs() << "** Instrumented " << Files.size() - Unchanged - Failed << " of " << Files.size()
+                 << " translation units into " << Project.OutDir << " (" << Unchanged << " unchanged, " << Failed
+                 << " failed)\n";
+    return Failed ? 1 : 0;
+}
+
 int main(int argc, const char **argv) {
-    auto ExpectedParser = CommonOptionsParser::create(argc, argv, ToolCategory);
+    auto ExpectedParser = CommonOptionsParser::create(argc, argv, ToolCategory, llvm::cl::ZeroOrMore);
     if (!ExpectedParser) {
         llvm::errs() << ExpectedParser.takeError();
         return 1;
     }
 
+    std::string ListError;
+    if ((!AllowListFile.empty() && !AllowList.load(AllowListFile, ListError)) ||
+        (!DenyListFile.empty() && !DenyList.load(DenyListFile, ListError))) {
+        llvm::errs() << ListError << "\n";
+        return 1;
+    }
+
     llvm::errs() << "PAPI events set: " << TraceEvents << "\n";
     setenv("TRACE_PAPI_EVENTS", TraceEvents.c_str(), 1);  // Optional
 
+    if (!OutputDir.empty()) {
+        // Without source paths the options parser loads no database.
+        if (!ExpectedParser->getSourcePathList().empty())
+            return instrumentProject(ExpectedParser->getCompilations(), ExpectedParser->getSourcePathList());
+        std::string Error;
+        auto Compilations = CompilationDatabase::autoDetectFromDirectory(
+            CompileCommandsDir.empty() ? ProjectRoot.getValue() : CompileCommandsDir.getValue(), Error);
+        if (!Compilations) {
+            llvm::errs() << Error << "\n";
+            return 1;
+        }
+        return instrumentProject(*Compilations, {});
+    }
+
+    if (ExpectedParser->getSourcePathList().empty()) {
+        llvm::errs() << "no input files (pass -output-dir to instrument the whole compilation database)\n";
+        return 1;
+    }
     ClangTool Tool(ExpectedParser->getCompilations(), ExpectedParser->getSourcePathList());
     return Tool.run(newFrontendActionFactory<InstrumentorFrontendAction>().get());
 }